@@ -0,0 +1,96 @@
+/*
+ *  changepoint.h
+ *  heartbeats
+ *
+ */
+
+#ifndef _CHANGEPOINT_H_
+#define _CHANGEPOINT_H_
+
+#include <stdint.h>
+
+/* two-sided Page-Hinkley test on relative deviations from the running mean, so the same
+ delta/threshold work for 1 beat/s and 1000 beats/s. header-only because both the heartbeat
+ library and the controller use it. */
+
+typedef struct changepoint {
+	double delta;		/* relative drift that is still considered noise */
+	double threshold;	/* cumulative relative drift that signals a change */
+	int64_t n;
+	double mean;
+	double up, up_min;	/* cumulative sum watching for an increase, and its minimum */
+	double down, down_max;	/* same for a decrease */
+	int64_t up_beat, up_time;	/* first sample after each sum last hit its extreme: the estimated onset */
+	int64_t down_beat, down_time;
+	int64_t onset_beat;	/* onset of the last detected change */
+	int64_t onset_time;
+} changepoint_t;
+
+static inline void changepoint_reset(changepoint_t *cp)
+{
+	cp->n = 0;
+	cp->mean = 0.0;
+	cp->up = cp->up_min = 0.0;
+	cp->down = cp->down_max = 0.0;
+	cp->up_beat = cp->down_beat = -1;
+	cp->up_time = cp->down_time = -1;
+}
+
+static inline void changepoint_init(changepoint_t *cp, double delta, double threshold)
+{
+	cp->delta = delta;
+	cp->threshold = threshold;
+	cp->onset_beat = cp->onset_time = -1;
+	changepoint_reset(cp);
+}
+
+/* feed one sample; returns 1 on an upward shift, -1 on a downward one, 0 otherwise.
+ after a detection the test restarts from the current sample. */
+static inline int changepoint_update(changepoint_t *cp, double x, int64_t beat, int64_t time)
+{
+	double dev;
+	int shift = 0;
+	
+	if (cp->n == 0) {
+		cp->n = 1;
+		cp->mean = x;
+		return 0;
+	}
+	dev = cp->mean != 0.0 ? (x - cp->mean) / cp->mean : 0.0;
+	cp->n++;
+	cp->mean += (x - cp->mean) / cp->n;
+	
+	cp->up += dev - cp->delta;
+	if (cp->up <= cp->up_min) {
+		cp->up_min = cp->up;
+		cp->up_beat = -1;
+	} else if (cp->up_beat < 0) {
+		cp->up_beat = beat;
+		cp->up_time = time;
+	}
+	cp->down += dev + cp->delta;
+	if (cp->down >= cp->down_max) {
+		cp->down_max = cp->down;
+		cp->down_beat = -1;
+	} else if (cp->down_beat < 0) {
+		cp->down_beat = beat;
+		cp->down_time = time;
+	}
+	
+	if (cp->up - cp->up_min > cp->threshold) {
+		shift = 1;
+		cp->onset_beat = cp->up_beat;
+		cp->onset_time = cp->up_time;
+	} else if (cp->down_max - cp->down > cp->threshold) {
+		shift = -1;
+		cp->onset_beat = cp->down_beat;
+		cp->onset_time = cp->down_time;
+	}
+	if (shift) {
+		changepoint_reset(cp);
+		changepoint_update(cp, x, beat, time);
+	}
+	return shift;
+}
+
+#endif
@@ -35,4 +35,8 @@ double hrm_get_max_rate(heart_rate_monitor_t volatile * hb);
 
 int64_t hrm_get_window_size(heart_rate_monitor_t volatile * hb);
 
+int64_t hrm_get_phase(heart_rate_monitor_t volatile * hb, int64_t * phase_beat);
+
+void hrm_set_phase_reset(heart_rate_monitor_t volatile * hb, int reset);
+
 #endif 
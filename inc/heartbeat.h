@@ -10,6 +10,8 @@
 #include <time.h>
 #include <pthread.h>
 
+#include "changepoint.h"
+
 typedef struct {
   int64_t beat;
   int tag;
@@ -31,6 +33,11 @@ typedef struct {
   int64_t read_index;
   char    valid;
 
+  /* phase changes, as seen by a change-point detector on inter-beat intervals */
+  int64_t phase_count;
+  int64_t phase_beat;      /* first beat of the current phase */
+  int64_t phase_time;
+  char    phase_reset;     /* set by a monitor: drop pre-change intervals from window_rate */
 
 } HB_global_state_t;
 
@@ -45,6 +52,8 @@ typedef struct {
   int steady_state;
   double last_average_time;
 
+  changepoint_t phase_detector;
+
   heartbeat_record_t* log;
 
   FILE* binary_file;
@@ -82,6 +91,8 @@ double hb_get_max_rate(heartbeat_t volatile * hb);
 
 int64_t hb_get_window_size(heartbeat_t volatile * hb);
 
+int64_t hb_get_phase(heartbeat_t volatile * hb, int64_t * phase_beat);
+
 int64_t heartbeat( heartbeat_t* hb, 
 		   int tag );
 
@@ -0,0 +1,490 @@
+/*
+ *  arbiter.c
+ *  heartbeats
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+
+#include "heart_rate_monitor.h"
+#include "machine_states.h"
+#include "power_model.h"
+#include "cpufreq_sysfs.h"
+#include "topology.h"
+
+#define fail_if(exp, msg) do { if ((exp)) { fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, (msg), strerror(errno)); goto fail; } } while (0)
+
+/* the consensus object from the TODO: one process that owns the cores and frequencies and splits them
+ between every heartbeat-enabled app, instead of one combined per app fighting over the same cores.
+
+ each period it measures every app's rate, learns how many beats per second it gets per kHz of
+ allocated frequency (summed over its cores), and works out the frequency each app needs to sit in
+ the middle of its band. apps are then served in order of priority, and within a priority the
+ cheapest first, so that as many as possible get there: each gets the fewest cores, from the ones
+ nobody has yet, that can run it at or below their top frequency, and the lowest frequency that
+ does it. if the machine can't fit every app mid-band, the whole thing is redone aiming just above
+ each min_heartrate. whoever is left without a core shares the last one handed out.
+
+ with a power cap, every period over the cap takes one frequency step away from the apps, lowest
+ priority first, and every period comfortably under it gives one back. cores nobody was given idle at
+ their lowest frequency. */
+
+#define MAX_APPS 64
+#define DEFAULT_PERIOD_MS 1000
+#define GAIN_SMOOTHING 0.5	/* how much each period's measurement moves an app's gain */
+#define MIN_RATE_MARGIN 0.05	/* when squeezed, aim this far above min_heartrate */
+#define POWER_HYSTERESIS 0.05	/* how far under the cap we must be to give a step back */
+
+typedef struct app {
+	int pid;
+	int priority;
+	int alive;	/* still in the heartbeat dir */
+	heart_rate_monitor_t hrm;
+	int64_t last_beat;
+	int64_t last_time;
+	double rate;	/* over the last period; 0 until known */
+	double gain;	/* beats per second per kHz of allocated frequency; 0 until known */
+	/* what we decided */
+	int first_core;
+	int core_count;	/* 0 if it shares first_core with whoever got it */
+	unsigned long freq;
+	int satisfied;
+	/* what is in force */
+	int applied_first;
+	int applied_count;
+	unsigned long applied_freq;
+} app_t;
+
+typedef struct priority_rule {
+	int pid;
+	int priority;
+} priority_rule_t;
+
+app_t apps[MAX_APPS];
+int app_count = 0;
+priority_rule_t rules[MAX_APPS];
+int rule_count = 0;
+char *heartbeat_dir;
+cpufreq_sysfs_t cpufreq_fds;
+topology_t topology;	/* cpu_count is 0 if sysfs wouldn't tell */
+int core_count;
+/* cores below are allocation slots: core sets are runs of slots, and the topology's policy says which cpu each slot is */
+unsigned long **core_freqs;	/* per core, lowest first */
+int *core_freq_count;
+unsigned long *core_applied;	/* frequency last written to each core */
+
+int get_core_count ()
+{
+	static int count = 0;
+	FILE *fp = NULL;
+	
+	if (topology.cpu_count) return topology.cpu_count;
+	if (!count) {
+		char buf[256];
+	
+		fp = fopen("/proc/cpuinfo", "r");
+		fail_if(!fp, "cannot open /proc/cpuinfo");
+		while (fgets(buf, sizeof(buf), fp))
+			if (strstr(buf, "processor"))
+				count++;
+		fclose(fp);
+	fail:
+		if (count < 1) count = 1;
+	}
+	return count;
+}
+
+int64_t get_time_ns()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int slot_cpu(int slot)
+{
+	return topology.cpu_count ? topology.order[slot] : slot;
+}
+
+/* app bookkeeping */
+
+int app_priority(int pid)
+{
+	int i;
+	
+	for (i = 0; i < rule_count; i++)
+		if (rules[i].pid == pid) return rules[i].priority;
+	return 0;
+}
+
+/* picks up new apps and forgets the ones that are gone */
+int scan_apps()
+{
+	DIR *dir;
+	struct dirent *entry;
+	int i, pid, found;
+	char *end;
+	
+	for (i = 0; i < app_count; i++)
+		apps[i].alive = 0;
+	dir = opendir(heartbeat_dir);
+	fail_if(dir == NULL, "cannot open heartbeat dir");
+	while ((entry = readdir(dir)) != NULL) {
+		pid = strtol(entry->d_name, &end, 10);
+		if (*end != 0 || end == entry->d_name) continue;
+		for (i = 0, found = 0; i < app_count && !found; i++)
+			if (apps[i].pid == pid) found = apps[i].alive = 1;
+		if (found || app_count == MAX_APPS) continue;
+		memset(&apps[app_count], 0, sizeof(app_t));
+		if (heart_rate_monitor_init(&apps[app_count].hrm, pid)) continue;
+		apps[app_count].pid = pid;
+		apps[app_count].priority = app_priority(pid);
+		apps[app_count].alive = 1;
+		apps[app_count].last_beat = -1;
+		apps[app_count].applied_first = -1;
+		app_count++;
+	}
+	closedir(dir);
+	
+	for (i = 0; i < app_count; )
+		if (!apps[i].alive) {
+			heart_rate_monitor_finish(&apps[i].hrm);
+			apps[i] = apps[--app_count];
+		} else
+			i++;
+	return 0;
+fail:
+	return -1;
+}
+
+/* the rate each app got over the last period, and what that says about its gain */
+void measure_apps()
+{
+	heartbeat_record_t current;
+	double gain, speed;
+	int i;
+	
+	for (i = 0; i < app_count; i++) {
+		app_t *app = &apps[i];
+	
+		if (hrm_get_current(&app->hrm, &current)) continue;
+		if (app->last_beat >= 0 && current.beat > app->last_beat && current.timestamp > app->last_time) {
+			app->rate = (current.beat - app->last_beat) * 1e9 / (current.timestamp - app->last_time);
+			speed = (double)app->applied_freq * (app->applied_count > 0 ? app->applied_count : 1);
+			if (app->applied_first >= 0 && speed > 0) {
+				gain = app->rate / speed;
+				app->gain = app->gain > 0 ? app->gain + GAIN_SMOOTHING * (gain - app->gain) : gain;
+			}
+		}
+		app->last_beat = current.beat;
+		app->last_time = current.timestamp;
+	}
+}
+
+double app_target(app_t *app, int squeezed)
+{
+	double min_rate = hrm_get_min_rate(&app->hrm), max_rate = hrm_get_max_rate(&app->hrm);
+	
+	if (squeezed || max_rate <= min_rate) return min_rate * (1.0 + MIN_RATE_MARGIN);
+	return (min_rate + max_rate) / 2.0;
+}
+
+/* kHz of frequency, summed over its cores, that the app needs; unknown apps get a core at full speed to learn on */
+double app_need(app_t *app, int squeezed)
+{
+	if (app->gain <= 0) return core_freqs[0][core_freq_count[0] - 1];
+	return app_target(app, squeezed) / app->gain;
+}
+
+/* the lowest frequency of a core at or above freq, or its top one */
+unsigned long core_freq_at_least(int core, double freq)
+{
+	int i;
+	
+	for (i = 0; i < core_freq_count[core]; i++)
+		if (core_freqs[core][i] >= freq) return core_freqs[core][i];
+	return core_freqs[core][core_freq_count[core] - 1];
+}
+
+/* allocation */
+
+int *order;	/* apps by priority, then need */
+double *needs;
+
+int compare_apps(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	
+	if (apps[x].priority != apps[y].priority) return apps[y].priority - apps[x].priority;
+	return needs[x] < needs[y] ? -1 : needs[x] > needs[y];
+}
+
+/* returns how many apps got what they need */
+int allocate(int core_budget, int squeezed)
+{
+	int i, n, next = 0, last = 0, satisfied = 0;
+	double top;
+	
+	for (i = 0; i < app_count; i++) {
+		order[i] = i;
+		needs[i] = app_need(&apps[i], squeezed);
+	}
+	qsort(order, app_count, sizeof(int), compare_apps);
+	
+	for (i = 0; i < app_count; i++) {
+		app_t *app = &apps[order[i]];
+	
+		if (next >= core_budget) {
+			/* nothing left: squeeze in with the last one */
+			app->first_core = last;
+			app->core_count = 0;
+			app->freq = core_freqs[last][core_freq_count[last] - 1];
+			app->satisfied = 0;
+			continue;
+		}
+		/* the fewest free cores whose top frequencies add up to the need. an app that needs nothing (its
+		 rates are 0) still runs somewhere: one core of its own, at the lowest frequency */
+		for (n = 0, top = 0; next + n < core_budget && (n == 0 || top < needs[order[i]]); n++)
+			top += core_freqs[next + n][core_freq_count[next + n] - 1];
+		app->first_core = next;
+		app->core_count = n;
+		app->satisfied = top >= needs[order[i]];
+		app->freq = core_freq_at_least(next, needs[order[i]] / n);
+		satisfied += app->satisfied;
+		last = next + n - 1;
+		next += n;
+	}
+	return satisfied;
+}
+
+/* takes frequency steps from the lowest-priority apps; returns how many it could take */
+int throttle(int steps)
+{
+	int i, k, taken = 0, progress = 1;
+	
+	while (taken < steps && progress)
+		for (i = app_count - 1, progress = 0; i >= 0 && taken < steps; i--) {
+			app_t *app = &apps[order[i]];
+	
+			for (k = core_freq_count[app->first_core] - 1; k >= 0 && core_freqs[app->first_core][k] >= app->freq; k--);
+			if (k < 0) continue;
+			app->freq = core_freqs[app->first_core][k];
+			app->satisfied = 0;
+			taken++;
+			progress = 1;
+			break;
+		}
+	return taken;
+}
+
+/* moves every thread of pid onto cores first .. first + count - 1 */
+int set_affinity(int pid, int first, int count)
+{
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *entry;
+	cpu_set_t set;
+	int core, tid, err = 0;
+	char *end;
+	
+	CPU_ZERO(&set);
+	for (core = first; core < first + count; core++)
+		CPU_SET(slot_cpu(core), &set);
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	dir = opendir(path);
+	if (!dir) return sched_setaffinity(pid, sizeof(set), &set);
+	while ((entry = readdir(dir)) != NULL) {
+		tid = strtol(entry->d_name, &end, 10);
+		if (*end != 0 || end == entry->d_name) continue;
+		if (sched_setaffinity(tid, sizeof(set), &set)) err = -1;
+	}
+	closedir(dir);
+	return err;
+}
+
+void apply()
+{
+	unsigned long want[core_count];
+	int i, core, first, count;
+	
+	for (core = 0; core < core_count; core++)
+		want[core] = core_freqs[core][0];
+	for (i = 0; i < app_count; i++) {
+		app_t *app = &apps[i];
+	
+		first = app->first_core;
+		count = app->core_count > 0 ? app->core_count : 1;
+		for (core = first; core < first + count; core++) {
+			/* cores of one app may differ in their lists; a shared core runs for the hungriest */
+			unsigned long freq = core_freq_at_least(core, app->freq);
+			if (freq > want[core]) want[core] = freq;
+		}
+		if (first != app->applied_first || count != app->applied_count) {
+			if (set_affinity(app->pid, first, count))
+				fprintf(stderr, "cannot set affinity of %d: %s\n", app->pid, strerror(errno));
+			app->applied_first = first;
+			app->applied_count = count;
+		}
+	}
+	for (core = 0; core < core_count; core++)
+		if (want[core] != core_applied[core]) {
+			if (cpufreq_sysfs_set(&cpufreq_fds, slot_cpu(core), want[core]))
+				fprintf(stderr, "cannot set frequency of cpu %d: %s\n", slot_cpu(core), strerror(errno));
+			else
+				core_applied[core] = want[core];
+		}
+	for (i = 0; i < app_count; i++)
+		apps[i].applied_freq = core_applied[apps[i].first_core];
+}
+
+void print_status(int64_t period, double power)
+{
+	int i;
+	
+	for (i = 0; i < app_count; i++) {
+		app_t *app = &apps[order[i]];
+	
+		printf("%lld\t%d\t%d\t%d\t%d\t%lu\t%.3f\t%.3f\t%.3f\t%c\t%.3f\n", (long long int)period, app->pid, app->priority,
+			app->first_core, app->core_count, app->applied_freq, app->rate,
+			hrm_get_min_rate(&app->hrm), hrm_get_max_rate(&app->hrm), app->satisfied ? '+' : '-', power);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	char *sysfs_root = NULL;
+	char *powercap_root = NULL;
+	int core_budget = 0;
+	double power_cap = 0.0;	/* W */
+	double period_ms = DEFAULT_PERIOD_MS;
+	int64_t period = 0, max_periods = -1;
+	int opt, err, core, steps = 0, taken;
+	int core_policy = TOPOLOGY_LINEAR;
+	rapl_t rapl;
+	int measuring_power = 0;
+	uint64_t energy, last_energy = 0;
+	int64_t now, last_time = 0;
+	double power = 0.0;
+	struct timespec next;
+	
+	while ((opt = getopt(argc, argv, "b:e:i:n:o:P:s:w:")) != -1) switch (opt) {
+		case 'b':
+			if (sscanf(optarg, "%d", &core_budget) < 1 || core_budget < 1) {
+				fprintf(stderr, "%s: bad core budget\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'e':
+			powercap_root = optarg;
+			break;
+		case 'i':
+			/* at least a nanosecond, and no nan or inf: the period is a whole number of ns */
+			if (sscanf(optarg, "%lf", &period_ms) < 1 || !(period_ms * 1e6 >= 1 && period_ms * 1e6 < (double)INT64_MAX)) {
+				fprintf(stderr, "%s: bad period\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'n':
+			max_periods = atoll(optarg);
+			break;
+		case 'o':
+			core_policy = topology_policy(optarg);
+			fail_if(core_policy < 0, "unknown core allocation policy");
+			break;
+		case 'P':
+			fail_if(rule_count == MAX_APPS, "too many priorities");
+			fail_if(sscanf(optarg, "%d:%d", &rules[rule_count].pid, &rules[rule_count].priority) != 2, "priorities are pid:priority");
+			rule_count++;
+			break;
+		case 's':
+			sysfs_root = optarg;
+			break;
+		case 'w':
+			power_cap = strtod(optarg, NULL);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b core_budget] [-e powercap_root] [-i period_ms] [-n periods] [-o linear|compact|spread|nosmt] [-P pid:priority]... [-s sysfs_root] [-w watts]\n", argv[0]);
+			exit(EXIT_FAILURE);
+	}
+	
+	heartbeat_dir = getenv("HEARTBEAT_ENABLED_DIR");
+	fail_if(!heartbeat_dir, "HEARTBEAT_ENABLED_DIR is not set");
+	if (topology_read(&topology, sysfs_root) == 0)
+		topology_set_policy(&topology, core_policy);
+	else
+		fail_if(core_policy != TOPOLOGY_LINEAR, "cannot read cpu topology for the allocation policy");
+	core_count = get_core_count();
+	if (core_budget > core_count) {
+		fprintf(stderr, "%s: core budget %d is more than the %d cores there are\n", argv[0], core_budget, core_count);
+		exit(EXIT_FAILURE);
+	}
+	if (core_budget == 0) core_budget = core_count;
+	
+	err = cpufreq_sysfs_open(&cpufreq_fds, sysfs_root, core_count);
+	fail_if(err, "cannot open cpufreq sysfs files");
+	core_freqs = calloc(core_count, sizeof(unsigned long *));
+	core_freq_count = calloc(core_count, sizeof(int));
+	core_applied = calloc(core_count, sizeof(unsigned long));
+	order = calloc(MAX_APPS, sizeof(int));
+	needs = calloc(MAX_APPS, sizeof(double));
+	fail_if(!core_freqs || !core_freq_count || !core_applied || !order || !needs, "cannot allocate core tables");
+	for (core = 0; core < core_count; core++) {
+		core_freq_count[core] = cpufreq_sysfs_frequencies(&cpufreq_fds, slot_cpu(core), &core_freqs[core]);
+		fail_if(core_freq_count[core] < 1, "cannot read frequency list");
+	}
+	if (power_cap > 0) {
+		err = rapl_open(&rapl, powercap_root);
+		fail_if(err, "cannot open RAPL counters for the power cap");
+		measuring_power = 1;
+	}
+	
+	/* header */
+	printf("period\tpid\tprio\tcore\tcores\tfreq\trate\tmin\tmax\tok\tpower\n");
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (max_periods < 0 || period < max_periods) {
+		next.tv_nsec += (long)(period_ms * 1e6);
+		next.tv_sec += next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+	
+		if (scan_apps()) continue;
+		measure_apps();
+		if (measuring_power && rapl_energy(&rapl, &energy) == 0) {
+			now = get_time_ns();
+			if (last_time) {
+				/* uJ per ns is kW */
+				power = (energy - last_energy) * 1e3 / (now - last_time);
+				if (power > power_cap) steps++;
+				else if (power < power_cap * (1.0 - POWER_HYSTERESIS) && steps > 0) steps--;
+			}
+			last_energy = energy;
+			last_time = now;
+		}
+	
+		if (allocate(core_budget, 0) < app_count)
+			allocate(core_budget, 1);
+		taken = throttle(steps);
+		/* there is only so much to take */
+		if (taken < steps) steps = taken;
+		apply();
+		print_status(period++, power);
+	}
+	
+	if (measuring_power) rapl_close(&rapl);
+	cpufreq_sysfs_close(&cpufreq_fds);
+	topology_free(&topology);
+	return 0;
+fail:
+	return 1;
+}
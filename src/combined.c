@@ -12,11 +12,18 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <dirent.h>
-#include <cpufreq.h>
 #include <limits.h>
+#include <pthread.h>
+#include <math.h>
+#include <sys/timerfd.h>
 #include "heart_rate_monitor.h"
 
 #include "machine_states.h"
+#include "power_model.h"
+#include "cpufreq_sysfs.h"
+#include "changepoint.h"
+#include "kalman.h"
+#include "topology.h"
 
 /*
  The best part of C is macros. The second best part of C is goto.
@@ -30,6 +37,63 @@
 
 #define DEBUG 0
 
+#define FRONTIER_FILTERS (FILTER_EQUIVALENT | FILTER_UNOPTIMAL | FILTER_IDLE)
+
+/* upper bound on the size of the speed -> state lookup table */
+#define SPEED_INDEX_MAX_BUCKETS 65536
+
+/* calibrated tables store rates in thousandths of a beat per second */
+#define CALIBRATED_SPEED_SCALE 1000.0
+
+/* how much of the rate-per-speed fit survives each new observation in machine_state_model_controller */
+#define RATE_MODEL_FORGETTING 0.98
+
+/* kalman rate estimator (-K): drift of the true rate per beat, doubt added when an actuation lands,
+ and how sure we must be again before deciding, all relative to the rate */
+#define RATE_ESTIMATE_DRIFT 0.02
+#define RATE_ESTIMATE_ACTUATION_DOUBT 0.5
+#define RATE_ESTIMATE_SETTLED 0.05
+#define RATE_ESTIMATE_NOISE_SMOOTHING 0.05
+
+/* timer-driven control (-T): consecutive tick rates this close mean an actuation has settled, and
+ how much each new settling time counts */
+#define CONTROL_SETTLED 0.05
+#define CONTROL_SETTLE_SMOOTHING 0.25
+
+/* MPC defaults: horizon in windows, and what a change of state costs relative to staying put */
+#define MPC_DEFAULT_HORIZON 4
+#define MPC_DEFAULT_SWITCH_COST 0.05
+#define MPC_TREND_SMOOTHING 0.1
+#define MPC_BAND_PENALTY 100.0	/* per relative unit of rate outside the band */
+
+/* PID defaults: derivative filter (the derivative acts up to N times Kp), and how many apps keep their own state */
+#define PID_DEFAULT_N 10.0
+#define PID_MAX_APPS 16
+
+/* cascaded controller defaults: inner (frequency) period in beats, outer (core) period in windows.
+ the outer loop adds a core when the inner one sits at the top of its range, and takes one away when
+ the rest could still run the app with headroom to spare */
+#define CASCADE_DEFAULT_INNER_PERIOD 2
+#define CASCADE_DEFAULT_OUTER_WINDOWS 4
+#define CASCADE_SATURATED 0.95
+#define CASCADE_HEADROOM 0.8
+
+/* power capping: how much each measured sample moves the correction of the predicted power */
+#define POWER_CAP_SMOOTHING 0.3
+
+/* deadline mode: headroom on the required rate, for the beats we spend reacting */
+#define DEADLINE_MARGIN 0.05
+
+/* refuse to enumerate more monotone states than this (16 cores with 12 frequencies are 3e7, and take seconds) */
+#define MAX_ENUMERATED_STATES 100000000UL
+
+/* with a measured power model, refit it after this many samples */
+#define POWER_REFIT_SAMPLES 50
+
+/* change-point parameters for spotting the effect of an actuation in the instant rate */
+#define LATENCY_CP_DELTA 0.05
+#define LATENCY_CP_THRESHOLD 1.0
+
 /* just my type */
 
 typedef struct actuator actuator_t;
@@ -43,6 +107,7 @@ struct actuator {
 	int64_t set_value;
 	int64_t min;
 	int64_t max;
+	int64_t applied_time;	/* when value last changed, in heartbeat timestamp units */
 	void *data;
 };
 
@@ -55,17 +120,101 @@ typedef struct freq_scaler_data {
 } freq_scaler_data_t;
 
 typedef struct machine_state_data {
-	unsigned long *states;
-	int state_count;
+	machine_model_t model;
+	state_table_t states;
+	speed_index_t speed_index;
 	actuator_t *core_act;
-	actuator_t *freq_acts[16];
+	actuator_t **freq_acts;
 	unsigned long *scratch_state;
+	power_model_t *power;	/* NULL unless power is measured */
+	int power_samples;
+	int measured;	/* the states come from a calibrated table, so speeds are in its units, not the model's */
+	unsigned long generation;	/* bumped whenever the frontier is rebuilt */
 } machine_state_data_t;
 
+/* time-division multiplexing between the two frontier states around the target speed */
+typedef struct dither {
+	int running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int64_t quantum;	/* ns */
+	actuator_t *speed_act;
+	int below, above;	/* the bracketing states */
+	double duty;	/* share of quanta spent in above */
+	double credit;	/* sigma-delta accumulator, so the share holds over any stretch of quanta */
+	int applied;	/* state in force, -1 if unknown; the controller reads this, not the actuators */
+	unsigned long *freqs;	/* the state being applied, copied so the lock isn't held while actuating */
+	int stop;
+} dither_t;
+
+/* refitted frontiers are built on a thread of their own: enumerating takes seconds on a big host,
+ and the beat loop only has to swap the result in */
+typedef struct frontier_rebuild {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int running;	/* started and not joined yet */
+	int done;	/* set by the thread, under the lock */
+	int err;
+	int pending;	/* the model moved again while the thread was at it */
+	machine_model_t model;	/* a copy: the power model keeps refitting the original */
+	state_table_t states;
+	speed_index_t speed_index;
+} frontier_rebuild_t;
+
+/* decoupled actuation: the controller posts targets, a worker thread applies them */
+
+typedef struct actuation_slot {
+	int64_t target;
+	int pending;
+	int64_t applied;
+	int64_t applied_time;
+} actuation_slot_t;
+
+typedef struct actuation_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int stop;
+	int count;
+	actuation_slot_t *slots;
+	actuator_t *acts;	/* the worker's own copies; they share data blocks with the controller's */
+} actuation_queue_t;
+
+/* actuation-to-effect latency, one log per actuator */
+
+typedef struct latency_sample {
+	int64_t target;
+	int64_t decision_time;
+	int64_t applied_time;	/* 0 until the actuator reports completion */
+	int64_t effect_beat;	/* -1 if superseded before any effect was seen */
+	int64_t effect_time;
+} latency_sample_t;
+
+typedef struct latency_log {
+	latency_sample_t *samples;
+	int count;
+	int size;
+	int open;	/* sample still waiting for its effect, or -1 */
+} latency_log_t;
+
 /* a global is fine too */
 
 heart_rate_monitor_t hrm;
 char *heartbeat_dir;
+cpufreq_sysfs_t cpufreq_fds;
+topology_t topology;	/* cpu_count is 0 if sysfs wouldn't tell */
+int machine_state_threads = 1;
+char *state_cache_file = NULL;	/* where machine_speed_init caches its frontier between runs; -c opts in */
+char *powercap_root = NULL;	/* measure power through RAPL if set */
+char *state_table_file = NULL;	/* use this table instead of generating one */
+char *calibration_file = NULL;
+int stop_requested = 0;	/* lets a decision function end the run */
+int decision_wait = 0;	/* beats to wait after acting, if a decision function wants something other than a window */
+dither_t dither = { .applied = -1 };
+frontier_rebuild_t frontier_rebuild = { .lock = PTHREAD_MUTEX_INITIALIZER };
+double pid_gains[4] = { -1, -1, 0, PID_DEFAULT_N };	/* Kp, Ki, Kd, N from -g; Kp and Ki default to -p and -q */
+latency_log_t *latency_logs = NULL;
+changepoint_t latency_detector;
 
 /* this is way simpler than spawning a process! */
 int get_heartbeat_apps(int *pids, int maxcount)
@@ -92,17 +241,19 @@ fail:
 
 void get_actuators(actuator_t **core_act, actuator_t **global_freq_act, int max_single_freq_acts, actuator_t **single_freq_acts, actuator_t **speed_act)
 {
-	int i;
+	int i, slot;
 	extern int actuator_count;
 	extern actuator_t *controls;
 	
 	for (i = 0; i < actuator_count; i++) {
+		/* single frequency actuators are indexed by allocation slot: the first n of them are the cpus of n allocated cores */
+		slot = controls[i].id == ACTUATOR_SINGLE_FREQ && topology.cpu_count ? topology.slot[controls[i].core] : controls[i].core;
 		if (controls[i].id == ACTUATOR_CORE_COUNT && core_act)
 			*core_act = &controls[i];
 		else if (controls[i].id == ACTUATOR_GLOBAL_FREQ && global_freq_act)
 			*global_freq_act = &controls[i];
-		else if (controls[i].id == ACTUATOR_SINGLE_FREQ && single_freq_acts && controls[i].core <= max_single_freq_acts)
-			single_freq_acts[controls[i].core] = &controls[i];
+		else if (controls[i].id == ACTUATOR_SINGLE_FREQ && single_freq_acts && slot < max_single_freq_acts)
+			single_freq_acts[slot] = &controls[i];
 		else if (controls[i].id == ACTUATOR_MACHINE_SPD && speed_act)
 			*speed_act = &controls[i];
 	}
@@ -115,6 +266,7 @@ int get_core_count ()
 	static int count = 0;
 	FILE *fp = NULL;
 
+	if (topology.cpu_count) return topology.cpu_count;
 	if (!count) {
 		char buf[256];
 
@@ -158,10 +310,13 @@ fail:
 
 int core_act (actuator_t *act)
 {
-	char command[256];
+	char command[PATH_MAX], list[PATH_MAX - 64];
 	int err;
 	
-	snprintf(command, sizeof(command), "taskset -pc 0-%d %d > /dev/null", (int)(act->set_value - 1), (int)act->pid);
+	if (topology.cpu_count && topology_cpu_list(&topology, act->set_value, list, sizeof(list)) >= 0)
+		snprintf(command, sizeof(command), "taskset -pc %s %d > /dev/null", list, (int)act->pid);
+	else
+		snprintf(command, sizeof(command), "taskset -pc 0-%d %d > /dev/null", (int)(act->set_value - 1), (int)act->pid);
 	err = system(command);
 	if (!err)
 		act->value = act->set_value;
@@ -170,28 +325,6 @@ int core_act (actuator_t *act)
 
 /* frequency scaler stuff */
 
-int create_freq_array(struct cpufreq_available_frequencies *freq_list, unsigned long **freq_array_p)
-{
-	struct cpufreq_available_frequencies *freq = freq_list;
-	int n = 0;
-	unsigned long *f;
-	
-	while (freq) {
-		n++;
-		freq = freq->next;
-	}
-	f = *freq_array_p = (unsigned long *) malloc(n * sizeof(unsigned long));
-	fail_if(!f, "cannot allocate freq array");
-	freq = freq_list;
-	while (freq) {
-		*f++ = freq->frequency;
-		freq = freq->next;
-	}
-	return n;
-fail:
-	return -1;
-}
-
 int get_freq_index(freq_scaler_data_t *data, unsigned long freq)
 {
 	int i;
@@ -202,35 +335,42 @@ int get_freq_index(freq_scaler_data_t *data, unsigned long freq)
 	return -1;
 }
 
+/* everything comes from the sysfs root given with -s, like the writes do, so a fake tree can stand in */
 int single_freq_init (actuator_t *act)
 {
-	int err;
-	struct cpufreq_policy *policy;
-	struct cpufreq_available_frequencies *freq_list;
+	int err, i;
 	freq_scaler_data_t *data;
-	unsigned long freq_min, freq_max;
+	unsigned long freq_min, freq_max, scaling_min, scaling_max, freq;
 	
 	act->data = data = malloc(sizeof(freq_scaler_data_t));
 	fail_if(!data, "cannot allocate freq data block");
 	
-	err = cpufreq_get_hardware_limits(act->core, &freq_min, &freq_max);
+	err = cpufreq_sysfs_read(&cpufreq_fds, act->core, "cpuinfo_min_freq", &freq_min) ||
+		cpufreq_sysfs_read(&cpufreq_fds, act->core, "cpuinfo_max_freq", &freq_max);
 	fail_if(err, "cannot get cpufreq hardware limits");
+	/* the kernel clamps whatever we ask for to the policy limits */
+	if (!cpufreq_sysfs_read(&cpufreq_fds, act->core, "scaling_min_freq", &scaling_min) && scaling_min > freq_min)
+		freq_min = scaling_min;
+	if (!cpufreq_sysfs_read(&cpufreq_fds, act->core, "scaling_max_freq", &scaling_max) && scaling_max < freq_max)
+		freq_max = scaling_max;
 	act->min = freq_min;
 	act->max = freq_max;
 	
-	policy = cpufreq_get_policy(act->core);
-	fail_if(!policy, "cannot get cpufreq policy");
-	if (strcmp(policy->governor, "userspace") != 0) {
-		err = cpufreq_modify_policy_governor(act->core, "userspace");
-		policy = cpufreq_get_policy(act->core);
-		fail_if (strcmp(policy->governor, "userspace") != 0, "cannot set cpufreq policy to userspace");
-	}
+	err = cpufreq_sysfs_set_governor(&cpufreq_fds, act->core, "userspace");
+	fail_if(err, "cannot set cpufreq policy to userspace");
 	
-	freq_list = cpufreq_get_available_frequencies(act->core);
-	data->freq_count = create_freq_array(freq_list, &data->freq_array);
+	data->freq_count = cpufreq_sysfs_frequencies(&cpufreq_fds, act->core, &data->freq_array);
 	fail_if(data->freq_count < 1, "cannot get frequency list");
+	/* the heuristics expect the fastest first, the way the kernel lists them */
+	for (i = 0; i < data->freq_count / 2; i++) {
+		freq = data->freq_array[i];
+		data->freq_array[i] = data->freq_array[data->freq_count - 1 - i];
+		data->freq_array[data->freq_count - 1 - i] = freq;
+	}
 	
-	act->value = act->set_value = cpufreq_get_freq_kernel(act->core);
+	err = cpufreq_sysfs_read(&cpufreq_fds, act->core, "scaling_cur_freq", &freq);
+	fail_if(err, "cannot get current frequency");
+	act->value = act->set_value = freq;
 	data->cur_index = get_freq_index(data, act->value);
 	
 	return 0;
@@ -238,53 +378,122 @@ fail:
 	return -1;
 }
 
+/* the global actuator writes one frequency to every cpu, so it can only use the ones they all have */
+static int keep_common_freqs(freq_scaler_data_t *data, int core_count)
+{
+	unsigned long *freqs = NULL;
+	int core, i, j, count, kept;
+	
+	for (core = 1; core < core_count; core++) {
+		count = cpufreq_sysfs_frequencies(&cpufreq_fds, core, &freqs);
+		fail_if(count < 1, "cannot get frequency list");
+		for (i = 0, kept = 0; i < data->freq_count; i++) {
+			for (j = 0; j < count && freqs[j] != data->freq_array[i]; j++)
+				;
+			if (j < count) data->freq_array[kept++] = data->freq_array[i];
+		}
+		data->freq_count = kept;
+		free(freqs);
+	}
+	return 0;
+fail:
+	return -1;
+}
+
 int global_freq_init (actuator_t *act)
 {
+	freq_scaler_data_t *data;
 	int err;
 	
-	act->core = 0;	/* just get all data from the first cpu and assume they're all the same */
+	act->core = 0;	/* get the current frequency and limits from the first cpu, and the frequencies every cpu has */
 	err = single_freq_init(act);
 	act->core = -1;
-	return err;
+	if (err) return err;
+	data = act->data;
+	err = keep_common_freqs(data, get_core_count());
+	fail_if(err, "cannot intersect frequency lists");
+	fail_if(data->freq_count < 1, "cpus have no frequency in common");
+	act->min = data->freq_array[data->freq_count - 1] < data->freq_array[0] ? data->freq_array[data->freq_count - 1] : data->freq_array[0];
+	act->max = data->freq_array[data->freq_count - 1] > data->freq_array[0] ? data->freq_array[data->freq_count - 1] : data->freq_array[0];
+	data->cur_index = get_freq_index(data, act->value);
+	return 0;
+fail:
+	return -1;
 }
 
+/* we write straight to the sysfs fds opened in main instead of going through libcpufreq:
+ it reopens the files on every call and masks sysfs errors with the ENOENT from /proc */
 int single_freq_act (actuator_t *act)
 {
-	int err = 0;
+	int err;
 	
-	err = cpufreq_set_frequency(act->core, act->set_value);
-	/* warning: cpufreq_set_frequency tries sysfs first, then proc; this means that if
-	 sysfs fails with EACCESS, the errno is then masked by the ENOENT from proc! */
-	act->value = cpufreq_get_freq_kernel(act->core);
+	err = cpufreq_sysfs_set(&cpufreq_fds, act->core, act->set_value);
+	if (!err)
+		act->value = act->set_value;
 	return err;
 }
 
 int global_freq_act (actuator_t *act)
 {
-	int err = 0;
-	int cpu;
+	int err;
 	
-	for (cpu = 0; cpu < get_core_count(); cpu++)
-		err = err || cpufreq_set_frequency(cpu, act->set_value);
-	/* warning: cpufreq_set_frequency tries sysfs first, then proc; this means that if
-	sysfs fails with EACCESS, the errno is then masked by the ENOENT from proc! */
-	act->value = cpufreq_get_freq_kernel(0);
+	err = cpufreq_sysfs_set_all(&cpufreq_fds, act->set_value);
+	if (!err)
+		act->value = act->set_value;
 	return err;
 }
 
 /* machine speed actuator */
 
-unsigned long get_current_speed(actuator_t *act)
+/* same clock as heartbeat(), so applied_time can be compared with beat timestamps */
+int64_t get_time_ns()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the state the dithering thread last put in force (or is about to, after a rebuild); the core and
+ frequency actuators belong to that thread, so the controller must not look at them */
+static int dither_state(void)
+{
+	int state;
+	
+	pthread_mutex_lock(&dither.lock);
+	state = dither.applied >= 0 ? dither.applied : dither.below;
+	pthread_mutex_unlock(&dither.lock);
+	return state;
+}
+
+/* fills the scratch state with what the core and frequency actuators are doing right now */
+static unsigned long *get_current_state(actuator_t *act)
 {
 	machine_state_data_t *data = act->data;
 	unsigned long *current_state = data->scratch_state;
-	int i, core_count = get_core_count();
+	int i, state, core_count = get_core_count();
 
-	for (i = 0; i < core_count; i++)
+	if (dither.running) {
+		state = dither_state();
+		for (i = 0; i < core_count; i++)
+			current_state[CORE_IDX(i)] = state_table_freq(&data->states, state, i);
+	} else for (i = 0; i < core_count; i++)
 		current_state[CORE_IDX(i)] = i < data->core_act->value ? data->freq_acts[i]->value : 0;
-	calculate_state_properties(current_state, core_count);
+	machine_model_state_properties(&data->model, current_state);
+	return current_state;
+}
+
+unsigned long get_current_speed(actuator_t *act)
+{
+	machine_state_data_t *data = act->data;
+	unsigned long *current_state = get_current_state(act);
+	int i;
+	
+	/* the model can't tell how fast a state is in a calibrated table's units, but the table can */
+	if (data->measured && (i = state_table_nearest(&data->states, current_state)) >= 0)
+		current_state[SPEED_IDX] = data->states.speed[i];
 #if DEBUG
-			int j;
+			int j, core_count = get_core_count();
 			printf("%lu\t%lu", current_state[SPEED_IDX], current_state[POWER_IDX]);
 			for (j = 0; j < core_count; j++)
 				printf("\t%lu", current_state[CORE_IDX(j)]);
@@ -293,55 +502,166 @@ unsigned long get_current_speed(actuator_t *act)
 	return current_state[SPEED_IDX];
 }
 
+/* cores with the same frequencies and capacity share a class. cpu_capacity is the speed at the top
+ frequency, so a core's speed per Hz relative to the biggest core is capacity / f_max against the biggest's.
+ there is nothing in sysfs about per-core power, so every class keeps the default power coefficients. */
+static int build_machine_model(machine_model_t *model, int core_count, actuator_t **freq_acts)
+{
+	freq_scaler_data_t *freq_data;
+	unsigned long capacity, ref_capacity = 0, ref_max = 0, speed_scale;
+	int core, k, class_index, err;
+	
+	err = machine_model_init(model, core_count);
+	fail_if(err, "cannot allocate machine model");
+	for (core = 0; core < core_count; core++) {
+		capacity = cpufreq_sysfs_capacity(&cpufreq_fds, freq_acts[core]->core);
+		if (capacity > ref_capacity) {
+			ref_capacity = capacity;
+			ref_max = freq_acts[core]->max;
+		}
+	}
+	for (core = 0; core < core_count; core++) {
+		freq_data = freq_acts[core]->data;
+		capacity = cpufreq_sysfs_capacity(&cpufreq_fds, freq_acts[core]->core);
+		speed_scale = CORE_SCALE_UNIT;
+		if (capacity && ref_capacity && freq_acts[core]->max > 0)
+			speed_scale = (unsigned long)((double)CORE_SCALE_UNIT * capacity * ref_max / ((double)ref_capacity * freq_acts[core]->max) + 0.5);
+		
+		for (class_index = -1, k = 0; k < model->class_count && class_index < 0; k++) {
+			core_class_t *class = &model->classes[k];
+			if (class->speed_scale == speed_scale && class->freq_count == freq_data->freq_count &&
+				memcmp(class->freqs, freq_data->freq_array, sizeof(unsigned long) * freq_data->freq_count) == 0)
+				class_index = k;
+		}
+		if (class_index < 0) {
+			class_index = machine_model_add_class(model, freq_data->freq_count, freq_data->freq_array, speed_scale, CORE_SCALE_UNIT, DEFAULT_STATIC_POWER);
+			fail_if(class_index < 0, "cannot add core class");
+		}
+		machine_model_set_class(model, core, class_index);
+	}
+	return 0;
+fail:
+	machine_model_free(model);
+	return -1;
+}
+
+static int build_machine_states(state_table_t *states, machine_model_t *model)
+{
+	unsigned long count;
+	int err;
+	
+	/* a big host would enumerate for hours; a calibrated table doesn't have to */
+	count = machine_model_state_count(model, 1);
+	if (count > MAX_ENUMERATED_STATES) {
+		errno = E2BIG;
+		fprintf(stderr, "%lu machine states are too many to enumerate, pass a state table with -f\n", count);
+	}
+	fail_if(count > MAX_ENUMERATED_STATES, "cannot generate machine states");
+	/* only monotone states are generated, and only the cheapest state for each speed is kept along the way,
+	 so we never hold the (freq_count+1)^core_count product or even all C(f+c, c) monotone states */
+	err = state_table_init(states, model->core_count, 4096);
+	fail_if(err, "cannot allocate machine states");
+	states->threads = machine_state_threads;
+	err = enumerate_states_parallel(states, model, 1, collect_cheapest_per_speed);
+	fail_if(err, "cannot generate machine states");
+	err = state_table_keep_cheapest_per_speed(states);
+	fail_if(err, "cannot sort machine states");
+	/* the all-off state is no use to anybody */
+	err = state_table_filter(states, FRONTIER_FILTERS) < 1;
+	fail_if(err, "cannot filter machine states");
+	return 0;
+fail:
+	return -1;
+}
+
+/* a state table from a file, e.g. one written by calibrate: its speeds are whatever it says, so it
+ is only cut down to a frontier */
+static int load_machine_states(state_table_t *states, const char *path, int core_count)
+{
+	int err;
+	
+	err = state_table_load(states, path, 0);
+	fail_if(err < 0, "cannot read state file");
+	if (err)
+		err = state_table_read_text(states, path);
+	fail_if(err, "cannot read state file");
+	if (states->core_count != core_count) {
+		errno = EINVAL;
+		fail_if(1, "state file is for another core count");
+	}
+	err = state_table_keep_cheapest_per_speed(states);
+	fail_if(err, "cannot sort machine states");
+	err = state_table_filter(states, FRONTIER_FILTERS) < 1;
+	fail_if(err, "no usable states in state file");
+	return 0;
+fail:
+	return -1;
+}
+
 int machine_speed_init (actuator_t *act)
 {
 	machine_state_data_t *data;
-	unsigned long *states, *all_states;
-	unsigned long *in_state, *out_state;
-	int state_count, filtered_count;
-	
-	int core_count, i;
-	freq_scaler_data_t *freq_data;
+	state_table_t *states;
+	int core_count, err;
+	uint64_t key;
 
-	act->data = data = malloc(sizeof(machine_state_data_t));
+	act->data = data = calloc(1, sizeof(machine_state_data_t));
 	fail_if(!data, "cannot allocate powerstate data block");
+	states = &data->states;
 
-	get_actuators(&data->core_act, NULL, 16, &data->freq_acts[0], NULL);
-	fail_if(data->core_act->max > 16, "too many cores lol");
-	freq_data = data->freq_acts[0]->data;
 	core_count = get_core_count();
+	data->freq_acts = calloc(core_count, sizeof(actuator_t *));
+	fail_if(!data->freq_acts, "cannot allocate frequency actuator list");
+	get_actuators(&data->core_act, NULL, core_count, &data->freq_acts[0], NULL);
+	err = build_machine_model(&data->model, core_count, data->freq_acts);
+	fail_if(err, "cannot build machine model");
+	if (powercap_root) {
+		data->power = malloc(sizeof(power_model_t));
+		fail_if(!data->power, "cannot allocate power model");
+		err = power_model_init(data->power, &data->model, powercap_root);
+		fail_if(err, "cannot set up the measured power model");
+	}
+	
+	if (state_table_file) {
+		err = load_machine_states(states, state_table_file, core_count);
+		fail_if(err, "cannot load machine states");
+		data->measured = 1;
+	}
 	
-	all_states = create_machine_states(&state_count, core_count, freq_data->freq_count, freq_data->freq_array);
-	fail_if(!all_states, "cannot generate machine states");
-
-	qsort(all_states, state_count, STATE_SIZE(core_count), compare_states_on_speed);
-	states = malloc(STATE_SIZE(core_count) * state_count);
-	for (i = 0, in_state = all_states, out_state = states, filtered_count = 0; i < state_count; i++, in_state+=STATE_LEN(core_count)) {
-		if (!redundant_state(in_state, core_count) &&
-			!drop_equivalent(in_state, i, all_states, state_count, core_count) &&
-			pareto_optimal(in_state, i, all_states, state_count, core_count) &&
-			in_state[SPEED_IDX] > 0)
-		{
+	/* the frontier only depends on the machine model and the filters, so reuse the last one. without
+	 a key, any cache would do, so there is none */
+	if (!data->measured && state_cache_file && state_table_key(&data->model, FRONTIER_FILTERS, &key)) {
+		fprintf(stderr, "warning: not using the state cache in %s\n", state_cache_file);
+		state_cache_file = NULL;
+	}
+	err = data->measured ? 0 : state_cache_file ? state_table_load(states, state_cache_file, key) : 1;
+	if (err == 0 && (states->core_count != core_count || states->count < 1)) {
+		state_table_free(states);
+		err = 1;
+	}
+	if (err) {
+		err = build_machine_states(states, &data->model);
+		fail_if(err, "cannot build machine states");
+		if (state_cache_file && state_table_save(states, state_cache_file, key))
+			fprintf(stderr, "warning: could not cache machine states in %s\n", state_cache_file);
+	}
 #if DEBUG
-			int j;
-			printf("%lu\t%lu", in_state[SPEED_IDX], in_state[POWER_IDX]);
-			for (j = 0; j < core_count; j++)
-				printf("\t%lu", in_state[CORE_IDX(j)]);
-			printf("\n");
-#endif
-			memmove (out_state, in_state, STATE_SIZE(core_count));
-			out_state += STATE_LEN(core_count);
-			filtered_count++;
-		}
+	int i, j;
+	for (i = 0; i < states->count; i++) {
+		printf("%lu\t%lu", states->speed[i], states->power[i]);
+		for (j = 0; j < core_count; j++)
+			printf("\t%lu", state_table_freq(states, i, j));
+		printf("\n");
 	}
-	data->state_count = state_count = filtered_count;
-	data->states = states = realloc(states, STATE_SIZE(core_count) * state_count);
-	free(all_states);
+#endif
 	
-	act->min = STATE_I(states, core_count, 0)[SPEED_IDX];
-	act->max = STATE_I(states, core_count, state_count-1)[SPEED_IDX];
+	act->min = states->speed[0];
+	act->max = states->speed[states->count - 1];
+	err = speed_index_build(&data->speed_index, states->speed, states->count, SPEED_INDEX_MAX_BUCKETS);
+	fail_if(err, "cannot build speed index");
 	
 	data->scratch_state = malloc(STATE_SIZE(core_count));
+	fail_if(!data->scratch_state, "cannot allocate scratch state");
 	act->value = act->set_value = get_current_speed(act);
 	
 	return 0;
@@ -349,38 +669,141 @@ fail:
 	return -1;
 }
 
+/* swaps in a frontier built from the machine model. refitted frontiers are not cached: the next run
+ starts from the default model again, and its cached frontier should still be there */
+static void swap_machine_states(actuator_t *act, state_table_t *states, speed_index_t *speed_index)
+{
+	machine_state_data_t *data = act->data;
+	
+	if (dither.running) pthread_mutex_lock(&dither.lock);
+	state_table_free(&data->states);
+	speed_index_free(&data->speed_index);
+	data->states = *states;
+	data->speed_index = *speed_index;
+	data->generation++;
+	act->min = states->speed[0];
+	act->max = states->speed[states->count - 1];
+	if (dither.running) {
+		/* the old indices mean nothing now; hold the nearest state until the next decision */
+		dither.below = dither.above = speed_index_lookup(speed_index, states->speed, states->count, act->value, NULL, NULL);
+		dither.duty = 0.0;
+		dither.applied = -1;
+		pthread_mutex_unlock(&dither.lock);
+	}
+}
+
+static void *frontier_rebuild_worker(void *arg)
+{
+	frontier_rebuild_t *fr = arg;
+	int err;
+	
+	err = build_machine_states(&fr->states, &fr->model);
+	if (!err && speed_index_build(&fr->speed_index, fr->states.speed, fr->states.count, SPEED_INDEX_MAX_BUCKETS)) {
+		fprintf(stderr, "cannot build speed index: %s\n", strerror(errno));
+		state_table_free(&fr->states);
+		err = -1;
+	}
+	pthread_mutex_lock(&fr->lock);
+	fr->err = err;
+	fr->done = 1;
+	pthread_mutex_unlock(&fr->lock);
+	return NULL;
+}
+
+static int frontier_rebuild_start(frontier_rebuild_t *fr, machine_model_t *model)
+{
+	int err;
+	
+	if (fr->running) {
+		fr->pending = 1;
+		return 0;
+	}
+	fail_if(machine_model_copy(&fr->model, model), "cannot copy machine model");
+	fr->done = 0;
+	fr->pending = 0;
+	err = pthread_create(&fr->thread, NULL, frontier_rebuild_worker, fr);
+	if (err) machine_model_free(&fr->model);
+	errno = err;
+	fail_if(err, "cannot start frontier rebuild thread");
+	fr->running = 1;
+	return 0;
+fail:
+	return -1;
+}
+
+/* joins a finished rebuild and swaps its frontier in; returns 1 if it did, 0 if there is nothing yet */
+static int frontier_rebuild_poll(frontier_rebuild_t *fr, actuator_t *act)
+{
+	int done;
+	
+	if (!fr->running) return 0;
+	pthread_mutex_lock(&fr->lock);
+	done = fr->done;
+	pthread_mutex_unlock(&fr->lock);
+	if (!done) return 0;
+	pthread_join(fr->thread, NULL);
+	fr->running = 0;
+	machine_model_free(&fr->model);
+	if (fr->err) return -1;
+	swap_machine_states(act, &fr->states, &fr->speed_index);
+	return 1;
+}
+
+static void frontier_rebuild_stop(frontier_rebuild_t *fr)
+{
+	if (!fr->running) return;
+	pthread_join(fr->thread, NULL);
+	fr->running = 0;
+	machine_model_free(&fr->model);
+	if (!fr->err) {
+		state_table_free(&fr->states);
+		speed_index_free(&fr->speed_index);
+	}
+}
+
+/* feeds the state in force from now on to the measured power model, and moves the frontier
+ when the fitted coefficients do */
+int machine_speed_observe (actuator_t *act)
+{
+	machine_state_data_t *data = act->data;
+	int err;
+	
+	if (!data->power) return 0;
+	err = frontier_rebuild_poll(&frontier_rebuild, act);
+	/* the model moved while that one was being built */
+	if (err > 0 && frontier_rebuild.pending) err = frontier_rebuild_start(&frontier_rebuild, &data->model);
+	if (err < 0) return err;
+	err = power_model_observe(data->power, get_current_state(act), get_time_ns());
+	if (err <= 0) return err;
+	if (++data->power_samples % POWER_REFIT_SAMPLES) return 0;
+	err = power_model_fit(data->power);
+	/* a calibrated table has speeds the model can't reproduce, so it stays as it is */
+	if (err > 0 && !data->measured) err = frontier_rebuild_start(&frontier_rebuild, &data->model);
+	return err;
+}
+
 int machine_speed_act (actuator_t *act)
 {
 	machine_state_data_t *data = act->data;
-	unsigned long *states = data->states;
+	state_table_t *states = &data->states;
 	int core_count = data->core_act->max;
-	int f = 0, t = data->state_count - 1, i;
-	unsigned long *state, *state2 = NULL;
-	int d;
+	int i, state, below, above;
 	
-	/* maybe we should check around the current state first? oh who cares */
-
-	/* binary search FTW */
-	do {
-		i = (t+f)/2;
-		state = STATE_I(states, core_count, i);
-		if (state[SPEED_IDX] == act->set_value) break;
-		else if (state[SPEED_IDX] < act->set_value) f = i + 1;
-		else if (state[SPEED_IDX] > act->set_value) t = i - 1;
-	} while (f < t);
-	
-	/* if it's not an exact match, maybe there's a closer one on the other side */
-	d = state[SPEED_IDX] - act->set_value;
-	if (d > 0) {
-		if (i > 0) state2 = STATE_I(states, core_count, i-1);
-	} else if (d < 0) {
-		if (i < data->state_count - 1) state2 = STATE_I(states, core_count, i+1);
-	}
-	if (state2 && abs(state2[SPEED_IDX] - act->set_value) < abs(d)) state = state2;
+	state = speed_index_lookup(&data->speed_index, states->speed, states->count, act->set_value, &below, &above);
+	if (dither.running) {
+		pthread_mutex_lock(&dither.lock);
+		dither.below = below;
+		dither.above = above;
+		dither.duty = above != below ? (double)(act->set_value - (long)states->speed[below]) / (states->speed[above] - states->speed[below]) : 0.0;
+		pthread_mutex_unlock(&dither.lock);
+		/* on average, we get exactly what was asked for (within the frontier) */
+		act->value = above != below ? act->set_value : (int64_t)states->speed[state];
+		return 0;
+	}
 	
 	/* now let's implement it */
-	for (i = 0; i < core_count && state[CORE_IDX(i)] > 0; i++)
-		data->freq_acts[i]->set_value = state[CORE_IDX(i)];
+	for (i = 0; i < core_count && state_table_freq(states, state, i) > 0; i++)
+		data->freq_acts[i]->set_value = state_table_freq(states, state, i);
 	data->core_act->set_value = i;
 #if DEBUG
 	if (i < 1) {
@@ -390,6 +813,354 @@ int machine_speed_act (actuator_t *act)
 	return 0;
 }
 
+/* dithering */
+/* with -t, the machine speed actuator no longer picks the state closest to the target: a thread
+ switches between the two frontier states bracketing it every quantum, spending the right share of
+ quanta in the faster one, so the average speed is the target. it owns the core count and per-core
+ frequency actuators while it runs; nothing else applies them. */
+
+static int dithered(actuator_t *act)
+{
+	return dither.running && (act->id == ACTUATOR_CORE_COUNT || act->id == ACTUATOR_SINGLE_FREQ);
+}
+
+/* what print_status shows for an actuator the dithering thread owns */
+static int64_t dithered_value(actuator_t *act)
+{
+	machine_state_data_t *data = dither.speed_act->data;
+	int i, state = dither_state(), core_count = data->core_act->max;
+	
+	for (i = 0; i < core_count && state_table_freq(&data->states, state, i) > 0; i++)
+		if (act == data->freq_acts[i]) return state_table_freq(&data->states, state, i);
+	return act == data->core_act ? i : 0;
+}
+
+/* same order as machine_speed_act: frequencies first, then the core count. runs without the lock,
+ on the copy in dither.freqs */
+static void dither_apply(machine_state_data_t *data)
+{
+	int i, core_count = data->core_act->max;
+	
+	for (i = 0; i < core_count && dither.freqs[i] > 0; i++) {
+		data->freq_acts[i]->set_value = dither.freqs[i];
+		if (data->freq_acts[i]->set_value != data->freq_acts[i]->value && data->freq_acts[i]->action_f(data->freq_acts[i]))
+			fprintf(stderr, "dither: frequency %d failed: %s\n", i, strerror(errno));
+	}
+	data->core_act->set_value = i;
+	if (data->core_act->set_value != data->core_act->value && data->core_act->action_f(data->core_act))
+		fprintf(stderr, "dither: core count failed: %s\n", strerror(errno));
+}
+
+static void *dither_worker(void *arg)
+{
+	machine_state_data_t *data = dither.speed_act->data;
+	struct timespec next;
+	unsigned long generation;
+	int i, state;
+	
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	pthread_mutex_lock(&dither.lock);
+	while (!dither.stop) {
+		dither.credit += dither.duty;
+		if (dither.credit >= 1.0) {
+			dither.credit -= 1.0;
+			state = dither.above;
+		} else state = dither.below;
+		if (state != dither.applied) {
+			for (i = 0; i < data->core_act->max; i++)
+				dither.freqs[i] = state_table_freq(&data->states, state, i);
+			generation = data->generation;
+			pthread_mutex_unlock(&dither.lock);
+			/* actuating can take a while (taskset), and machine_speed_act shouldn't wait for it */
+			dither_apply(data);
+			pthread_mutex_lock(&dither.lock);
+			/* a rebuild in the meantime renumbered the states and already reset applied */
+			if (generation == data->generation) dither.applied = state;
+		}
+		pthread_mutex_unlock(&dither.lock);
+		
+		next.tv_nsec += dither.quantum % 1000000000;
+		next.tv_sec += dither.quantum / 1000000000 + next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+		pthread_mutex_lock(&dither.lock);
+	}
+	pthread_mutex_unlock(&dither.lock);
+	return NULL;
+}
+
+int dither_start(actuator_t *speed_act, int64_t quantum)
+{
+	machine_state_data_t *data = speed_act->data;
+	int err;
+	
+	dither.speed_act = speed_act;
+	dither.quantum = quantum;
+	dither.freqs = calloc(data->core_act->max, sizeof(unsigned long));
+	fail_if(!dither.freqs, "cannot allocate dithering state");
+	dither.below = dither.above = speed_index_lookup(&data->speed_index, data->states.speed, data->states.count, speed_act->value, NULL, NULL);
+	dither.duty = dither.credit = 0.0;
+	dither.applied = -1;
+	dither.stop = 0;
+	pthread_mutex_init(&dither.lock, NULL);
+	dither.running = 1;
+	err = pthread_create(&dither.thread, NULL, dither_worker, NULL);
+	if (err) dither.running = 0;
+	errno = err;
+	fail_if(err, "cannot start dithering thread");
+	return 0;
+fail:
+	return -1;
+}
+
+void dither_stop(void)
+{
+	if (!dither.running) return;
+	pthread_mutex_lock(&dither.lock);
+	dither.stop = 1;
+	pthread_mutex_unlock(&dither.lock);
+	pthread_join(dither.thread, NULL);
+	dither.running = 0;
+	free(dither.freqs);
+	dither.freqs = NULL;
+}
+
+/* asynchronous actuation */
+
+/* the machine speed actuator only computes targets for the others, so it stays on the controller thread */
+static int runs_async(actuator_t *act)
+{
+	return act->id != ACTUATOR_MACHINE_SPD && !dithered(act);
+}
+
+static void *actuation_worker(void *arg)
+{
+	actuation_queue_t *q = arg;
+	int i, err, busy;
+	
+	pthread_mutex_lock(&q->mutex);
+	while (!q->stop) {
+		busy = 0;
+		for (i = 0; i < q->count; i++) {
+			actuator_t *act = &q->acts[i];
+			if (!q->slots[i].pending) continue;
+			/* only the latest target survives; anything posted while we act gets picked up next round */
+			act->set_value = q->slots[i].target;
+			q->slots[i].pending = 0;
+			busy = 1;
+			pthread_mutex_unlock(&q->mutex);
+			err = act->value != act->set_value ? act->action_f(act) : 0;
+			if (err) fprintf(stderr, "action %d failed: %s\n", act->id, strerror(errno));
+			pthread_mutex_lock(&q->mutex);
+			q->slots[i].applied = act->value;
+			q->slots[i].applied_time = get_time_ns();
+			/* a failed actuation has landed too, on the old value: the controller must not wait for it
+			 forever, and posts the target again at its next decision */
+			if (err && !q->slots[i].pending) q->slots[i].target = act->value;
+		}
+		if (!busy && !q->stop) pthread_cond_wait(&q->cond, &q->mutex);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return NULL;
+}
+
+int actuation_queue_start(actuation_queue_t *q, int act_count, actuator_t *acts)
+{
+	int i, err;
+	
+	q->stop = 0;
+	q->count = act_count;
+	q->slots = malloc(sizeof(actuation_slot_t) * act_count);
+	q->acts = malloc(sizeof(actuator_t) * act_count);
+	fail_if(!q->slots || !q->acts, "cannot allocate actuation queue");
+	for (i = 0; i < act_count; i++) {
+		q->acts[i] = acts[i];
+		q->slots[i] = (actuation_slot_t) { .target = acts[i].value, .pending = 0, .applied = acts[i].value, .applied_time = acts[i].applied_time };
+	}
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	err = pthread_create(&q->thread, NULL, actuation_worker, q);
+	errno = err;
+	fail_if(err, "cannot start actuation thread");
+	return 0;
+fail:
+	return -1;
+}
+
+void actuation_queue_stop(actuation_queue_t *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	q->stop = 1;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	pthread_join(q->thread, NULL);
+	free(q->slots);
+	free(q->acts);
+}
+
+/* hand every changed target to the worker, replacing any not yet applied; returns how many changed */
+int actuation_queue_post(actuation_queue_t *q, actuator_t *acts)
+{
+	int i, posted = 0;
+	
+	pthread_mutex_lock(&q->mutex);
+	for (i = 0; i < q->count; i++) {
+		if (!runs_async(&acts[i]) || acts[i].set_value == q->slots[i].target) continue;
+		q->slots[i].target = acts[i].set_value;
+		q->slots[i].pending = 1;
+		posted++;
+	}
+	if (posted) pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+	return posted;
+}
+
+/* copy the values the worker has actually applied back into the controller's view; returns how many are still in flight */
+int actuation_queue_sync(actuation_queue_t *q, actuator_t *acts)
+{
+	int i, in_flight = 0;
+	
+	pthread_mutex_lock(&q->mutex);
+	for (i = 0; i < q->count; i++) {
+		if (!runs_async(&acts[i])) continue;
+		acts[i].value = q->slots[i].applied;
+		acts[i].applied_time = q->slots[i].applied_time;
+		if (q->slots[i].pending || q->slots[i].applied != q->slots[i].target) in_flight++;
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return in_flight;
+}
+
+/* actuation latency instrumentation */
+
+int latency_init(int act_count)
+{
+	int i;
+	
+	latency_logs = calloc(act_count, sizeof(latency_log_t));
+	fail_if(!latency_logs, "cannot allocate latency logs");
+	for (i = 0; i < act_count; i++)
+		latency_logs[i].open = -1;
+	changepoint_init(&latency_detector, LATENCY_CP_DELTA, LATENCY_CP_THRESHOLD);
+	return 0;
+fail:
+	return -1;
+}
+
+/* a new actuation supersedes whatever the previous one was still waiting for */
+void latency_actuated(int act_index, int64_t target, int64_t decision_time)
+{
+	latency_log_t *log = &latency_logs[act_index];
+	
+	/* an asynchronous actuation stays unapplied for a few beats; don't count it again */
+	if (log->open >= 0 && log->samples[log->open].target == target) return;
+	if (log->count >= log->size) {
+		int size = log->size ? log->size * 2 : 64;
+		latency_sample_t *samples = realloc(log->samples, sizeof(latency_sample_t) * size);
+		if (!samples) return;
+		log->samples = samples;
+		log->size = size;
+	}
+	log->samples[log->count] = (latency_sample_t) { .target = target, .decision_time = decision_time, .applied_time = 0, .effect_beat = -1, .effect_time = -1 };
+	log->open = log->count++;
+}
+
+/* call once per observed beat: picks up completion times and closes samples when the rate shifts */
+void latency_beat(heartbeat_record_t *current, int act_count, actuator_t *acts)
+{
+	int i, shift;
+	
+	for (i = 0; i < act_count; i++) {
+		latency_log_t *log = &latency_logs[i];
+		latency_sample_t *sample;
+		if (log->open < 0) continue;
+		sample = &log->samples[log->open];
+		if (!sample->applied_time && acts[i].applied_time >= sample->decision_time)
+			sample->applied_time = acts[i].applied_time;
+	}
+	
+	shift = changepoint_update(&latency_detector, current->instant_rate, current->beat, current->timestamp);
+	if (!shift) return;
+	
+	for (i = 0; i < act_count; i++) {
+		latency_log_t *log = &latency_logs[i];
+		latency_sample_t *sample;
+		if (log->open < 0) continue;
+		sample = &log->samples[log->open];
+		/* a shift that started before the actuation landed is not its effect */
+		if (!sample->applied_time || latency_detector.onset_time < sample->applied_time) continue;
+		sample->effect_beat = latency_detector.onset_beat;
+		sample->effect_time = latency_detector.onset_time;
+		log->open = -1;
+	}
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_latency_distribution(FILE *fp, int id, int core, const char *kind, int64_t *values, int n)
+{
+	qsort(values, n, sizeof(int64_t), compare_int64);
+	fprintf(fp, "%d\t%d\t%s\t%d\t%.3f\t%.3f\t%.3f\t%.3f\n", id, core, kind, n,
+		values[0] / 1e6, values[n / 2] / 1e6, values[(n * 9) / 10] / 1e6, values[n - 1] / 1e6);
+}
+
+/* raw samples, then per-actuator distributions in ms */
+int latency_export(char *file_name, int act_count, actuator_t *acts)
+{
+	FILE *fp;
+	int i, j, n;
+	int64_t *apply_lat = NULL, *effect_lat = NULL;
+	
+	fp = fopen(file_name, "w");
+	fail_if(!fp, "cannot open latency file");
+	
+	fprintf(fp, "act\tcore\tdecision\tapplied\teffect_beat\teffect_time\n");
+	for (i = 0; i < act_count; i++)
+		for (j = 0; j < latency_logs[i].count; j++) {
+			latency_sample_t *sample = &latency_logs[i].samples[j];
+			fprintf(fp, "%d\t%d\t%lld\t%lld\t%lld\t%lld\n", acts[i].id, acts[i].core,
+				(long long)sample->decision_time, (long long)sample->applied_time,
+				(long long)sample->effect_beat, (long long)sample->effect_time);
+		}
+	
+	fprintf(fp, "\nact\tcore\tlatency\tcount\tmin\tp50\tp90\tmax\n");
+	for (i = 0; i < act_count; i++) {
+		latency_log_t *log = &latency_logs[i];
+		if (!log->count) continue;
+		apply_lat = realloc(apply_lat, sizeof(int64_t) * log->count);
+		effect_lat = realloc(effect_lat, sizeof(int64_t) * log->count);
+		fail_if(!apply_lat || !effect_lat, "cannot allocate latency buffers");
+		for (j = 0, n = 0; j < log->count; j++) {
+			if (!log->samples[j].applied_time) continue;
+			apply_lat[n] = log->samples[j].applied_time - log->samples[j].decision_time;
+			if (log->samples[j].effect_beat >= 0)
+				effect_lat[n] = log->samples[j].effect_time - log->samples[j].applied_time;
+			else effect_lat[n] = -1;
+			n++;
+		}
+		if (n) print_latency_distribution(fp, acts[i].id, acts[i].core, "apply", apply_lat, n);
+		/* superseded samples sort first as -1, drop them */
+		qsort(effect_lat, n, sizeof(int64_t), compare_int64);
+		for (j = 0; j < n && effect_lat[j] < 0; j++);
+		if (n - j) print_latency_distribution(fp, acts[i].id, acts[i].core, "effect", effect_lat + j, n - j);
+	}
+	
+	free(apply_lat);
+	free(effect_lat);
+	fclose(fp);
+	return 0;
+fail:
+	free(apply_lat);
+	free(effect_lat);
+	if (fp) fclose(fp);
+	return -1;
+}
+
 /* decision functions */
 
 void dummy_control (heartbeat_record_t *hb, int act_count, actuator_t *acts, double param1, double param2)
@@ -504,6 +1275,112 @@ void step_heuristics (heartbeat_record_t *current, int act_count, actuator_t *ac
 	}
 }
 
+/* cascaded control: a fast inner loop on the global frequency and a slow outer loop on the core count.
+ the inner loop runs every param1 beats (default 2) on the rate measured since its last change, which
+ is fresher than the window's, and jumps straight to the frequency that should put the rate mid-band.
+ the outer loop runs every param2 beats (default 4 windows) and moves the inner loop's operating point:
+ it adds a core if the frequency was pinned near the top the whole time, and removes one if the other
+ cores could carry the load below CASCADE_HEADROOM of the top frequency. either way the frequency is
+ rescaled with it, so the rate doesn't jump. unlike uncoordinated_heuristics, both never move at once
+ and cores change rarely, so a tight band doesn't make the allocation thrash. */
+
+typedef struct cascade {
+	int64_t start_beat;	/* inner loop measures from here; -1 after any change */
+	int64_t start_time;
+	int64_t outer_beat;	/* last outer decision */
+	double load_sum;	/* frequency / top frequency, summed over inner decisions since then */
+	int load_count;
+} cascade_t;
+
+cascade_t cascade = { .start_beat = -1, .outer_beat = -1 };
+
+/* the lowest available frequency at or above freq, or the top one */
+static unsigned long cascade_freq_at_least(freq_scaler_data_t *data, double freq)
+{
+	unsigned long best = 0;
+	int i;
+	
+	for (i = 0; i < data->freq_count; i++)
+		if (data->freq_array[i] >= freq && (!best || data->freq_array[i] < best)) best = data->freq_array[i];
+	if (!best)
+		for (i = 0; i < data->freq_count; i++)
+			if (data->freq_array[i] > best) best = data->freq_array[i];
+	return best;
+}
+
+static void cascade_set_freq(actuator_t *freq_act, unsigned long freq)
+{
+	freq_scaler_data_t *freq_data = freq_act->data;
+	
+	freq_act->set_value = freq;
+	freq_data->cur_index = get_freq_index(freq_data, freq);
+}
+
+void cascaded_controller (heartbeat_record_t *current, int act_count, actuator_t *acts, double param1, double param2)
+{
+	static actuator_t *core_act = NULL, *freq_act = NULL;
+	cascade_t *c = &cascade;
+	int inner_period = param1 >= 1 ? param1 : CASCADE_DEFAULT_INNER_PERIOD;
+	int64_t outer_period = param2 >= 1 ? param2 : CASCADE_DEFAULT_OUTER_WINDOWS * hrm_get_window_size(&hrm);
+	double min_rate = hrm_get_min_rate(&hrm), max_rate = hrm_get_max_rate(&hrm);
+	double target_rate = (min_rate + max_rate) / 2.0;
+	double rate, load, freq;
+	int64_t cores;
+	
+	if (!core_act) get_actuators(&core_act, &freq_act, 0, NULL, NULL);
+	if (c->outer_beat < 0) c->outer_beat = current->beat;
+	if (c->start_beat < 0 || current->beat <= c->start_beat || current->timestamp <= c->start_time) {
+		c->start_beat = current->beat;
+		c->start_time = current->timestamp;
+		return;
+	}
+	
+	/* outer loop */
+	if (current->beat - c->outer_beat >= outer_period && c->load_count > 0) {
+		load = c->load_sum / c->load_count;
+		cores = core_act->value;
+		if (load >= CASCADE_SATURATED && cores < core_act->max) cores++;
+		else if (cores > core_act->min && load * cores / (cores - 1) <= CASCADE_HEADROOM) cores--;
+		c->outer_beat = current->beat;
+		c->load_sum = 0.0;
+		c->load_count = 0;
+		if (cores != core_act->value) {
+			/* hand the inner loop a frequency that keeps the same total speed */
+			cascade_set_freq(freq_act, cascade_freq_at_least(freq_act->data, (double)freq_act->value * core_act->value / cores));
+			core_act->set_value = cores;
+			c->start_beat = -1;
+			decision_wait = hrm_get_window_size(&hrm);
+			return;
+		}
+	}
+	
+	/* inner loop */
+	if (current->beat - c->start_beat < inner_period) return;
+	rate = (current->beat - c->start_beat) * 1e9 / (current->timestamp - c->start_time);
+	c->load_sum += (double)freq_act->value / freq_act->max;
+	c->load_count++;
+	if (rate >= min_rate && rate <= max_rate) return;
+	freq = cascade_freq_at_least(freq_act->data, freq_act->value * target_rate / rate);
+	/* rounding up can land back where we are: then take one step */
+	if (freq == freq_act->value && rate > max_rate) {
+		freq_scaler_data_t *freq_data = freq_act->data;
+		int i;
+		
+		for (i = 0; i < freq_data->freq_count; i++)
+			if (freq_data->freq_array[i] < freq_act->value && (freq == freq_act->value || freq_data->freq_array[i] > freq))
+				freq = freq_data->freq_array[i];
+	}
+	if (freq != freq_act->value) {
+		cascade_set_freq(freq_act, freq);
+		c->start_beat = -1;
+		decision_wait = 1;
+	} else {
+		/* nothing to do at this frequency; measure afresh */
+		c->start_beat = current->beat;
+		c->start_time = current->timestamp;
+	}
+}
+
 /*
  P controller:
 	e = sp - y
@@ -609,6 +1486,651 @@ void machine_state_histeresis_pseudo_pi_controller (heartbeat_record_t *current,
 	old_error = error;
 }
 
+/* a textbook positional PID on the machine speed, with time in seconds between decisions:
+ - the integral is a real sum of Ki * error * dt, not the last error
+ - back-calculation anti-windup: the integral is pulled back by (applied - asked) / Tt, and since
+   "applied" is the speed of the state we'll actually get, quantization counts as saturation too
+ - the derivative is on the measurement, not the error, so target changes don't kick, and is
+   low-pass filtered with time constant Kd / (N * Kp)
+ - bumpless: on the first decision, or when someone else moved the actuator, the integral is set so
+   the output starts from wherever the speed is now
+ gains come from -g Kp,Ki,Kd[,N], or -p Kp -q Ki for a PI. */
+
+typedef struct pid_state {
+	int pid;	/* the app's */
+	int started;
+	double integral;
+	double derivative;
+	double last_rate;
+	int64_t last_time;
+	int64_t last_output;
+} pid_state_t;
+
+pid_state_t pid_states[PID_MAX_APPS];
+
+static pid_state_t *pid_state_for(int pid)
+{
+	int i;
+	
+	for (i = 0; i < PID_MAX_APPS; i++)
+		if (pid_states[i].started && pid_states[i].pid == pid) return &pid_states[i];
+	for (i = 0; i < PID_MAX_APPS; i++)
+		if (!pid_states[i].started) {
+			pid_states[i].pid = pid;
+			return &pid_states[i];
+		}
+	return &pid_states[0];	/* more apps than we expected: share */
+}
+
+void machine_state_pid_controller (heartbeat_record_t *current, int act_count, actuator_t *acts, double param1, double param2)
+{
+	static actuator_t *speed_act = NULL;
+	machine_state_data_t *data;
+	state_table_t *states;
+	pid_state_t *st;
+	double Kp = pid_gains[0] >= 0 ? pid_gains[0] : param1;
+	double Ki = pid_gains[1] >= 0 ? pid_gains[1] : param2;
+	double Kd = pid_gains[2], N = pid_gains[3];
+	double target_rate = (hrm_get_max_rate(&hrm) + hrm_get_min_rate(&hrm)) / 2.0;
+	double rate = current->window_rate, error = target_rate - rate;
+	double dt, p_term, output, applied, tf, alpha, tt;
+	
+	if (!speed_act) get_actuators(NULL, NULL, 0, NULL, &speed_act);
+	data = speed_act->data;
+	states = &data->states;
+	st = pid_state_for(speed_act->pid);
+	p_term = Kp * error;
+	
+	if (!st->started || speed_act->value != st->last_output) {
+		/* bumpless transfer */
+		st->started = 1;
+		st->derivative = 0.0;
+		st->integral = speed_act->value - p_term;
+		dt = 0.0;
+	} else {
+		dt = (current->timestamp - st->last_time) / 1e9;
+		if (dt > 0 && Kd > 0) {
+			tf = Kp > 0 && N > 0 ? Kd / (N * Kp) : 0.0;
+			alpha = tf / (tf + dt);
+			st->derivative = alpha * st->derivative - (1.0 - alpha) * Kd * (rate - st->last_rate) / dt;
+		}
+	}
+	
+	output = p_term + st->integral + st->derivative;
+	speed_act->set_value = output < speed_act->min ? speed_act->min : output > speed_act->max ? speed_act->max : output;
+	/* dithering averages out any speed between the frontier states, so only snap to one without it;
+	 either way, the anti-windup term sees the speed we'll actually get on average */
+	if (!dither.running)
+		speed_act->set_value = states->speed[speed_index_lookup(&data->speed_index, states->speed, states->count, speed_act->set_value, NULL, NULL)];
+	applied = speed_act->set_value;
+	
+	if (dt > 0 && Ki > 0) {
+		/* Tt = sqrt(Ti * Td) is the usual choice; Ti alone without a derivative */
+		tt = Kd > 0 ? sqrt(Kd / Ki) : Kp > 0 ? Kp / Ki : 1.0;
+		st->integral += Ki * error * dt + (applied - output) * dt / tt;
+	}
+#if DEBUG
+	printf("target: %f hr: %f P %f I %f D %f -> %f (applied %f)\n", target_rate, rate, p_term, st->integral, st->derivative, output, applied);
+#endif
+	st->last_rate = rate;
+	st->last_time = current->timestamp;
+	st->last_output = speed_act->set_value;
+}
+
+/* learns the rate the app actually gets in each frontier state, instead of assuming that it is
+ proportional to speed: every state visited gets a Kalman estimate of its rate, and the others are
+ predicted from a rate/speed gain fitted over all observations (least squares with forgetting). when
+ the rate leaves the band, we jump to the state predicted to land closest to its middle, so once the
+ model knows the neighbourhood it takes one or two actuations instead of a long P/PI oscillation.
+ param1 is the measurement noise and param2 the drift per beat, both relative to the rate
+ (defaults 0.05 and 0.01). */
+
+typedef struct rate_model {
+	unsigned long *speeds;	/* the frontier the estimates are for, NULL until reset */
+	unsigned long generation;	/* and its generation: a rebuilt frontier may reuse the old address */
+	int state_count;
+	kalman_t *rates;
+	int64_t *last_beat;	/* last observation of each state, -1 if never */
+	double gain_num, gain_den;
+} rate_model_t;
+
+rate_model_t rate_model;
+
+static int rate_model_reset(rate_model_t *m, machine_state_data_t *data)
+{
+	state_table_t *states = &data->states;
+	int i;
+	
+	free(m->rates);
+	free(m->last_beat);
+	memset(m, 0, sizeof(*m));
+	m->rates = calloc(states->count, sizeof(kalman_t));
+	m->last_beat = malloc(sizeof(int64_t) * states->count);
+	fail_if(!m->rates || !m->last_beat, "cannot allocate rate model");
+	for (i = 0; i < states->count; i++)
+		m->last_beat[i] = -1;
+	m->speeds = states->speed;
+	m->generation = data->generation;
+	m->state_count = states->count;
+	return 0;
+fail:
+	return -1;
+}
+
+static int rate_model_stale(rate_model_t *m, machine_state_data_t *data)
+{
+	return !m->speeds || m->generation != data->generation;
+}
+
+static double rate_model_predict(rate_model_t *m, int i)
+{
+	if (m->last_beat[i] >= 0) return m->rates[i].x;
+	return m->gain_den > 0 ? m->gain_num / m->gain_den * m->speeds[i] : 0.0;
+}
+
+static void rate_model_observe(rate_model_t *m, int i, double rate, int64_t beat, double noise, double drift)
+{
+	kalman_t *k = &m->rates[i];
+	double prior;
+	
+	if (m->last_beat[i] < 0) {
+		/* a new state starts from what the gain says, with a lot of doubt */
+		prior = m->gain_den > 0 ? m->gain_num / m->gain_den * m->speeds[i] : rate;
+		kalman_init(k, prior, prior * prior / 4 + 1e-9, (drift * rate) * (drift * rate), (noise * rate) * (noise * rate) + 1e-9);
+	} else if (beat > m->last_beat[i]) {
+		/* it has been drifting since we last saw it */
+		k->p += k->q * (beat - m->last_beat[i]);
+	}
+	kalman_update(k, rate);
+	m->last_beat[i] = beat;
+	
+	m->gain_num = RATE_MODEL_FORGETTING * m->gain_num + m->speeds[i] * rate;
+	m->gain_den = RATE_MODEL_FORGETTING * m->gain_den + (double)m->speeds[i] * m->speeds[i];
+}
+
+void machine_state_model_controller (heartbeat_record_t *current, int act_count, actuator_t *acts, double noise, double drift)
+{
+	static actuator_t *speed_act = NULL;
+	rate_model_t *m = &rate_model;
+	machine_state_data_t *data;
+	state_table_t *states;
+	double target_rate = (hrm_get_max_rate(&hrm) + hrm_get_min_rate(&hrm)) / 2.0;
+	double error, best_error = -1;
+	int i, state, best = 0;
+	
+	if (!speed_act) get_actuators(NULL, NULL, 0, NULL, &speed_act);
+	data = speed_act->data;
+	states = &data->states;
+	if (noise <= 0) noise = 0.05;
+	if (drift <= 0) drift = 0.01;
+	/* the frontier is rebuilt when the power model moves; what we learned is for the old one */
+	if (rate_model_stale(m, data) && rate_model_reset(m, data)) return;
+	
+	/* the main loop waits a whole window after each change, so this rate is all the current state's */
+	state = speed_index_lookup(&data->speed_index, states->speed, states->count, speed_act->value, NULL, NULL);
+	rate_model_observe(m, state, current->window_rate, current->beat, noise, drift);
+	if (current->window_rate >= hrm_get_min_rate(&hrm) && current->window_rate <= hrm_get_max_rate(&hrm))
+		return;
+	
+	/* ties go to the cheaper state, which comes first */
+	for (i = 0; i < states->count; i++) {
+		error = fabs(rate_model_predict(m, i) - target_rate);
+		if (best_error < 0 || error < best_error) {
+			best_error = error;
+			best = i;
+		}
+	}
+#if DEBUG
+	printf("rate %f in state %d (predicted %f); target %f -> state %d (predicted %f)\n", current->window_rate, state,
+		m->rates[state].x, target_rate, best, rate_model_predict(m, best));
+#endif
+	speed_act->set_value = states->speed[best];
+}
+
+/* power capping: runs the fastest frontier state whose power fits in param1 watts, whatever the heart
+ rate band says. with -e, a state's power is the fitted idle power plus its power column, both in mW,
+ times how far off the model has been on the measured samples; when a sample comes in over the cap
+ anyway, we back off below the current state. without -e nothing is measured and the budget is in the
+ frontier's own power units. */
+void machine_state_power_cap_controller (heartbeat_record_t *current, int act_count, actuator_t *acts, double budget, double param2)
+{
+	static actuator_t *speed_act = NULL;
+	static double correction = 1.0;
+	static int seen_samples = 0;
+	machine_state_data_t *data;
+	state_table_t *states;
+	double cap, idle = 0.0;
+	int i, state, best = -1, over = 0;
+	
+	if (!speed_act) get_actuators(NULL, NULL, 0, NULL, &speed_act);
+	data = speed_act->data;
+	states = &data->states;
+	if (budget <= 0 || states->count < 1) return;
+	state = speed_index_lookup(&data->speed_index, states->speed, states->count, speed_act->value, NULL, NULL);
+	
+	if (data->power) {
+		cap = budget * 1000.0;
+		idle = data->power->idle_power;
+		if (data->power_samples != seen_samples && data->power->last_predicted > 0) {
+			seen_samples = data->power_samples;
+			correction += POWER_CAP_SMOOTHING * (data->power->last_power / data->power->last_predicted - correction);
+			over = data->power->last_power > cap;
+		}
+	} else
+		cap = budget;
+	
+	for (i = 0; i < states->count; i++)
+		if ((idle + states->power[i]) * correction <= cap && (best < 0 || states->speed[i] > states->speed[best]))
+			best = i;
+	/* nothing fits: the cheapest state is as close as we get */
+	if (best < 0)
+		for (i = 0, best = 0; i < states->count; i++)
+			if (states->power[i] < states->power[best]) best = i;
+	if (over && states->speed[best] >= states->speed[state])
+		for (i = 0; i < states->count; i++)
+			if (states->speed[i] < states->speed[state] && (states->speed[best] >= states->speed[state] || states->speed[i] > states->speed[best]))
+				best = i;
+#if DEBUG
+	printf("cap %f correction %f state %d -> %d\n", cap, correction, state, best);
+#endif
+	speed_act->set_value = states->speed[best];
+}
+
+/* deadline mode: get to beat param1 by param2, in seconds since the epoch, or seconds from the first
+ decision if it's too small to be a date. each decision recomputes the rate still needed from the beats
+ and time left, and runs the cheapest frontier state predicted to deliver it, using the same learned
+ rates as machine_state_model_controller. falling behind raises the needed rate, so slack gets used up
+ slowly at first and the controller speeds up as it shrinks. once the beats are done we idle along in
+ the cheapest state; once the deadline has passed, all we can do is hurry. */
+void machine_state_deadline_controller (heartbeat_record_t *current, int act_count, actuator_t *acts, double target_beats, double deadline)
+{
+	static actuator_t *speed_act = NULL;
+	static int64_t deadline_ns = -1;
+	rate_model_t *m = &rate_model;
+	machine_state_data_t *data;
+	state_table_t *states;
+	double remaining_beats, remaining_time, needed;
+	int state, best;
+	
+	if (!speed_act) get_actuators(NULL, NULL, 0, NULL, &speed_act);
+	data = speed_act->data;
+	states = &data->states;
+	if (deadline_ns < 0) deadline_ns = deadline > 1e9 ? deadline * 1e9 : current->timestamp + deadline * 1e9;
+	if (rate_model_stale(m, data) && rate_model_reset(m, data)) return;
+	
+	state = speed_index_lookup(&data->speed_index, states->speed, states->count, speed_act->value, NULL, NULL);
+	rate_model_observe(m, state, current->window_rate, current->beat, 0.05, 0.01);
+	
+	remaining_beats = target_beats - hrm.state->counter;
+	remaining_time = (deadline_ns - current->timestamp) / 1e9;
+	if (remaining_beats <= 0) best = 0;
+	else if (remaining_time <= 0) best = states->count - 1;
+	else {
+		needed = remaining_beats / remaining_time * (1.0 + DEADLINE_MARGIN);
+		/* the frontier gets dearer as it gets faster */
+		for (best = 0; best < states->count - 1 && rate_model_predict(m, best) < needed; best++);
+	}
+#if DEBUG
+	printf("%f beats in %f s: state %d -> %d (predicted %f)\n", remaining_beats, remaining_time, state, best, rate_model_predict(m, best));
+#endif
+	speed_act->set_value = states->speed[best];
+}
+
+/* model-predictive control: plans param1 windows ahead (default 4) over the frontier. the rate of each
+ state comes from the same learned model as machine_state_model_controller, scaled by the trend the
+ rate has been following, so ramps between phases are seen coming. the objective is energy per beat,
+ relative to the current state's, plus a steep penalty for leaving the band and param2 (default 0.05)
+ for each change of state, since every change costs a window of waiting. a dynamic program over
+ (step, state) finds the best plan in O(horizon * states); only its first step is taken. */
+
+typedef struct mpc {
+	double trend;	/* relative change of the rate per beat, smoothed */
+	double last_rate;
+	int last_state;
+	int64_t last_beat;
+	double *value;	/* cost-to-go per state */
+	double *next_value;
+} mpc_t;
+
+mpc_t mpc = { .last_state = -1 };
+
+static double mpc_stage_cost(state_table_t *states, int i, double rate, double min_rate, double max_rate, double unit_energy)
+{
+	double violation = 0.0;
+	
+	if (rate < min_rate) violation = (min_rate - rate) / min_rate;
+	else if (rate > max_rate) violation = (rate - max_rate) / max_rate;
+	if (rate < 1e-9) rate = 1e-9;
+	return states->power[i] / rate / unit_energy + MPC_BAND_PENALTY * violation;
+}
+
+void machine_state_mpc_controller (heartbeat_record_t *current, int act_count, actuator_t *acts, double param1, double param2)
+{
+	static actuator_t *speed_act = NULL;
+	rate_model_t *m = &rate_model;
+	machine_state_data_t *data;
+	state_table_t *states;
+	int horizon = param1 >= 1 ? param1 : MPC_DEFAULT_HORIZON;
+	double switch_cost = param2 > 0 ? param2 : MPC_DEFAULT_SWITCH_COST;
+	double min_rate = hrm_get_min_rate(&hrm), max_rate = hrm_get_max_rate(&hrm);
+	double rate = current->window_rate, window = hrm_get_window_size(&hrm);
+	double unit_energy, scale, best_next, cost, best_cost = -1, *swap;
+	int i, h, state, best = 0;
+	
+	if (!speed_act) get_actuators(NULL, NULL, 0, NULL, &speed_act);
+	data = speed_act->data;
+	states = &data->states;
+	if (rate_model_stale(m, data)) {
+		if (rate_model_reset(m, data)) return;
+		free(mpc.value);
+		free(mpc.next_value);
+		mpc = (mpc_t) { .last_state = -1 };
+		mpc.value = malloc(sizeof(double) * states->count);
+		mpc.next_value = malloc(sizeof(double) * states->count);
+		if (!mpc.value || !mpc.next_value) {
+			m->speeds = NULL;
+			return;
+		}
+	}
+	
+	state = speed_index_lookup(&data->speed_index, states->speed, states->count, speed_act->value, NULL, NULL);
+	/* the trend is only visible while nothing else moves the rate */
+	if (state == mpc.last_state && current->beat > mpc.last_beat && mpc.last_rate > 0)
+		mpc.trend += MPC_TREND_SMOOTHING * ((rate - mpc.last_rate) / (mpc.last_rate * (current->beat - mpc.last_beat)) - mpc.trend);
+	mpc.last_state = state;
+	mpc.last_rate = rate;
+	mpc.last_beat = current->beat;
+	rate_model_observe(m, state, rate, current->beat, 0.05, 0.01);
+	
+	unit_energy = states->power[state] / (rate > 1e-9 ? rate : 1e-9);
+	if (unit_energy <= 0) unit_energy = 1.0;
+	
+	/* backwards over the horizon: value[s] is the best cost from step h on, being in s at step h */
+	for (i = 0; i < states->count; i++)
+		mpc.value[i] = 0.0;
+	for (h = horizon - 1; h >= 0; h--) {
+		scale = 1.0 + mpc.trend * window * h;
+		if (scale < 0) scale = 0;
+		for (i = 0, best_next = -1; i < states->count; i++)
+			if (best_next < 0 || mpc.value[i] < best_next) best_next = mpc.value[i];
+		for (i = 0; i < states->count; i++) {
+			cost = mpc.value[i] < best_next + switch_cost ? mpc.value[i] : best_next + switch_cost;
+			mpc.next_value[i] = cost + mpc_stage_cost(states, i, rate_model_predict(m, i) * scale, min_rate, max_rate, unit_energy);
+		}
+		swap = mpc.value;
+		mpc.value = mpc.next_value;
+		mpc.next_value = swap;
+	}
+	for (i = 0; i < states->count; i++) {
+		cost = mpc.value[i] + (i != state ? switch_cost : 0.0);
+		if (best_cost < 0 || cost < best_cost) {
+			best_cost = cost;
+			best = i;
+		}
+	}
+#if DEBUG
+	printf("mpc: rate %f trend %f state %d -> %d (cost %f)\n", rate, mpc.trend, state, best, best_cost);
+#endif
+	speed_act->set_value = states->speed[best];
+}
+
+/* heart rate estimation */
+/* with -K, a Kalman filter over the rate between consecutive beats we see replaces the window average
+ as the decision functions' input. the measurement noise is learned from the innovations. when an
+ actuation lands, the estimate's variance is inflated, so it follows the new rate within a few beats
+ instead of a window. the main loop then decides again as soon as the estimate has settled. */
+
+typedef struct rate_estimator {
+	int started;
+	kalman_t k;
+	double noise;	/* running mean of the squared innovations */
+	int64_t last_beat, last_time;
+	int64_t last_applied;	/* newest applied_time seen on any actuator */
+	int pending;	/* an actuation was decided but hasn't landed yet */
+} rate_estimator_t;
+
+rate_estimator_t rate_estimator;
+
+/* the estimate's standard deviation is small next to the estimate, and no actuation is in flight */
+int rate_estimate_settled(rate_estimator_t *e)
+{
+	return e->started && !e->pending && sqrt(e->k.p) <= RATE_ESTIMATE_SETTLED * fabs(e->k.x);
+}
+
+void rate_estimator_update(rate_estimator_t *e, heartbeat_record_t *current, int act_count, actuator_t *acts)
+{
+	double z, x, innovation, floor;
+	int64_t beats;
+	int i, landed = 0;
+	
+	for (i = 0; i < act_count; i++)
+		if (acts[i].applied_time > e->last_applied) {
+			e->last_applied = acts[i].applied_time;
+			landed = 1;
+		}
+	if (!e->started) {
+		x = current->window_rate > 0 ? current->window_rate : current->instant_rate;
+		if (x <= 0) return;
+		kalman_init(&e->k, x, (0.5 * x) * (0.5 * x), 0.0, (0.2 * x) * (0.2 * x));
+		e->noise = e->k.r;
+		e->last_beat = current->beat;
+		e->last_time = current->timestamp;
+		e->started = 1;
+		return;
+	}
+	if (current->beat <= e->last_beat || current->timestamp <= e->last_time) return;
+	
+	/* we may have missed beats; the average over the gap is what we know */
+	beats = current->beat - e->last_beat;
+	z = beats * 1e9 / (current->timestamp - e->last_time);
+	x = e->k.x;
+	e->k.q = (RATE_ESTIMATE_DRIFT * x) * (RATE_ESTIMATE_DRIFT * x) * beats;
+	kalman_predict(&e->k);
+	if (landed) {
+		e->k.p += (RATE_ESTIMATE_ACTUATION_DOUBT * x) * (RATE_ESTIMATE_ACTUATION_DOUBT * x);
+		e->pending = 0;
+	}
+	innovation = z - x;
+	e->noise += RATE_ESTIMATE_NOISE_SMOOTHING * (innovation * innovation - e->noise);
+	/* innovations also carry the estimate's own doubt, which isn't measurement noise */
+	floor = (0.01 * x) * (0.01 * x) + 1e-12;
+	e->k.r = e->noise - e->k.p > floor ? e->noise - e->k.p : floor;
+	kalman_update(&e->k, z);
+	e->last_beat = current->beat;
+	e->last_time = current->timestamp;
+}
+
+/* timer-driven control */
+/* with -T, decisions happen on a fixed timerfd period instead of on every beat. each tick summarizes
+ every beat since the previous one: the beat counter and timestamps are all a mean rate needs, so the
+ ring overflowing between ticks at 100k beats/s costs nothing. a slow app that hasn't beaten in a
+ while is at most as fast as one beat in that time, which we can act on before its next beat.
+ after an actuation, decisions wait for the longest of one period and the settling time observed so
+ far: the time until two consecutive tick rates agree. */
+
+typedef struct control_timer {
+	int fd;
+	int64_t period;	/* ns */
+	int64_t last_beat;	/* where the previous summary ended */
+	int64_t last_time;
+	double last_rate;
+	int64_t acted_time;	/* last actuation, while we time its settling; -1 otherwise */
+	int64_t prev_tick;
+	double prev_rate;
+	double settle;	/* smoothed settling time, ns */
+	int64_t hold_until;	/* no decisions before this */
+} control_timer_t;
+
+control_timer_t control_timer = { .fd = -1 };
+
+int control_timer_start(control_timer_t *t, int64_t period)
+{
+	struct itimerspec spec;
+	
+	t->period = period;
+	t->last_beat = -1;
+	t->last_rate = 0.0;
+	t->acted_time = -1;
+	t->settle = 0.0;
+	t->hold_until = 0;
+	spec.it_interval.tv_sec = period / 1000000000;
+	spec.it_interval.tv_nsec = period % 1000000000;
+	spec.it_value = spec.it_interval;
+	t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	fail_if(t->fd < 0, "cannot create control timer");
+	fail_if(timerfd_settime(t->fd, 0, &spec, NULL), "cannot arm control timer");
+	return 0;
+fail:
+	if (t->fd >= 0) close(t->fd);
+	t->fd = -1;
+	return -1;
+}
+
+void control_timer_stop(control_timer_t *t)
+{
+	if (t->fd >= 0) close(t->fd);
+	t->fd = -1;
+}
+
+/* waits for the next tick and summarizes the beats since the last one into current, with the mean
+ rate as window_rate. returns 1 if there is something to decide on, 0 if not, -1 on errors */
+int control_timer_tick(control_timer_t *t, heartbeat_record_t *current)
+{
+	uint64_t expirations;
+	int64_t now;
+	double rate;
+	
+	if (read(t->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return errno == EINTR ? 0 : -1;
+	if (hrm_get_current(&hrm, current)) return 0;
+	now = get_time_ns();
+	if (t->last_beat < 0) {
+		t->last_beat = current->beat;
+		t->last_time = current->timestamp;
+		return 0;
+	}
+	if (current->beat > t->last_beat && current->timestamp > t->last_time) {
+		rate = (current->beat - t->last_beat) * 1e9 / (current->timestamp - t->last_time);
+		t->last_beat = current->beat;
+		t->last_time = current->timestamp;
+	} else if (now > current->timestamp && 1e9 / (now - current->timestamp) < t->last_rate) {
+		rate = 1e9 / (now - current->timestamp);
+	} else
+		return 0;
+	current->window_rate = rate;
+	t->last_rate = rate;
+	
+	if (t->acted_time >= 0) {
+		if (t->prev_rate > 0 && fabs(rate - t->prev_rate) <= CONTROL_SETTLED * t->prev_rate) {
+			if (t->settle <= 0) t->settle = t->prev_tick - t->acted_time;
+			else t->settle += CONTROL_SETTLE_SMOOTHING * (t->prev_tick - t->acted_time - t->settle);
+			t->acted_time = -1;
+		} else {
+			t->prev_rate = rate;
+			t->prev_tick = now;
+		}
+	}
+	return 1;
+}
+
+/* call after acting; the next summary starts from the latest beat */
+void control_timer_acted(control_timer_t *t)
+{
+	heartbeat_record_t latest;
+	int64_t now = get_time_ns();
+	
+	if (hrm_get_current(&hrm, &latest) == 0) {
+		t->last_beat = latest.beat;
+		t->last_time = latest.timestamp;
+	}
+	t->acted_time = now;
+	t->prev_rate = 0.0;
+	t->hold_until = now + (t->settle > t->period ? (int64_t)t->settle : t->period);
+}
+
+int control_timer_holding(control_timer_t *t)
+{
+	return get_time_ns() < t->hold_until;
+}
+
+/* offline calibration: walks a reference workload through every state of the frontier and records the
+ rate it actually gets in each, as a state table for -f. param1 is how many beats to average over
+ (default: one window), after the window the main loop already waits out after each change. with -e,
+ power is measured as well. */
+
+typedef struct calibration {
+	int state;	/* frontier state being measured, -1 before the first */
+	int beats;
+	double rate_sum;
+	int64_t start_time;
+	uint64_t start_energy;
+	int have_energy;
+	state_table_t table;	/* a copy of the frontier that gets the measurements */
+} calibration_t;
+
+calibration_t calibration = { .state = -1 };
+
+static int finish_calibration(void)
+{
+	FILE *f;
+	int err;
+	
+	f = fopen(calibration_file, "w");
+	fail_if(!f, "cannot create calibration file");
+	err = state_table_write_text(&calibration.table, f);
+	err = fclose(f) || err;
+	fail_if(err, "cannot write calibration file");
+	fprintf(stderr, "calibrated %d states into %s\n", calibration.table.count, calibration_file);
+	return 0;
+fail:
+	return -1;
+}
+
+void calibrate (heartbeat_record_t *current, int act_count, actuator_t *acts, double param1, double param2)
+{
+	static actuator_t *speed_act = NULL;
+	machine_state_data_t *data;
+	int samples = param1 >= 1 ? param1 : hrm_get_window_size(&hrm);
+	uint64_t energy;
+	int64_t now;
+	
+	if (!speed_act) get_actuators(NULL, NULL, 0, NULL, &speed_act);
+	data = speed_act->data;
+	if (calibration.state < 0) {
+		if (state_table_init(&calibration.table, data->states.core_count, data->states.count) ||
+			state_table_append_table(&calibration.table, &data->states)) {
+			fprintf(stderr, "cannot copy the frontier for calibration\n");
+			stop_requested = 1;
+			return;
+		}
+		calibration.state = 0;
+		speed_act->set_value = data->states.speed[0];
+		return;
+	}
+	
+	now = get_time_ns();
+	if (calibration.beats == 0) {
+		calibration.start_time = now;
+		calibration.have_energy = data->power && rapl_energy(&data->power->rapl, &calibration.start_energy) == 0;
+	}
+	calibration.rate_sum += current->window_rate;
+	if (++calibration.beats < samples) return;
+	
+	calibration.table.speed[calibration.state] = calibration.rate_sum / calibration.beats * CALIBRATED_SPEED_SCALE + 0.5;
+	if (calibration.have_energy && now > calibration.start_time && rapl_energy(&data->power->rapl, &energy) == 0)
+		calibration.table.power[calibration.state] = (energy - calibration.start_energy) * 1e6 / (now - calibration.start_time) + 0.5;	/* mW */
+	fprintf(stderr, "state %d/%d: %.3f beats/s\n", calibration.state + 1, calibration.table.count, calibration.rate_sum / calibration.beats);
+	
+	calibration.beats = 0;
+	calibration.rate_sum = 0;
+	if (++calibration.state >= calibration.table.count) {
+		if (finish_calibration())
+			fprintf(stderr, "calibration results lost\n");
+		stop_requested = 1;
+		return;
+	}
+	speed_act->set_value = data->states.speed[calibration.state];
+}
+
 /* BACK TO ZA CHOPPA */
 
 void print_status(heartbeat_record_t *current, int64_t skip_until_beat, char action, int act_count, actuator_t *controls)
@@ -617,7 +2139,7 @@ void print_status(heartbeat_record_t *current, int64_t skip_until_beat, char act
 
 	printf("%lld\t%.3f\t%lld\t%c", (long long int)current->beat, current->window_rate, (long long int)skip_until_beat, action);
 	for (i = 0; i < act_count; i++)
-		printf("\t%lld", controls[i].value);
+		printf("\t%lld", (long long int)(dithered(&controls[i]) ? dithered_value(&controls[i]) : controls[i].value));
 	printf("\n");
 }
 
@@ -642,12 +2164,26 @@ int main(int argc, char **argv)
 	decision_function_t decision_f = NULL;
 	double param1 = 0.0, param2 = 0.0;
 	int acted;
+	char *sysfs_root = CPUFREQ_SYSFS_DEFAULT_ROOT;
+	int core_policy = TOPOLOGY_LINEAR;
+	int async = 0;
+	actuation_queue_t queue;
+	int in_flight = 0, was_in_flight = 0;	/* asynchronous actuations not applied yet */
+	int64_t applied_wait = 0;	/* beats to wait once they are */
+	char *latency_file = NULL;
+	int64_t decision_time;
+	double dither_quantum = 0.0;	/* ms */
+	double control_period = 0.0;	/* ms; 0 decides on beats */
+	int estimate_rate = 0;
+	int phase_reset = 0;
+	int64_t phase = 0;
+	int64_t settle_until_beat = 0;
 
 	/* we want to see this in realtime even when it's piped through tee */
 	setlinebuf(stdout);
 	
 	/* getting rich with stock options */	
-	while ((opt = getopt(argc, argv, "d:p:q:")) != -1) switch (opt) {
+	while ((opt = getopt(argc, argv, "ac:Cd:e:f:g:j:k:Kl:o:p:q:rs:t:T:")) != -1) switch (opt) {
 		case 'd':
 			if (strcmp(optarg, "dummy_control") == 0) decision_f = dummy_control;
 			else if (strcmp(optarg, "core_heuristics") == 0) decision_f = core_heuristics;
@@ -659,11 +2195,22 @@ int main(int argc, char **argv)
 			else if (strcmp(optarg, "machine_state_pseudo_pi_controller") == 0) decision_f = machine_state_pseudo_pi_controller;
 			else if (strcmp(optarg, "machine_state_histeresis_p_controller") == 0) decision_f = machine_state_histeresis_p_controller;
 			else if (strcmp(optarg, "machine_state_histeresis_pseudo_pi_controller") == 0) decision_f = machine_state_histeresis_pseudo_pi_controller;
+			else if (strcmp(optarg, "machine_state_pid_controller") == 0) decision_f = machine_state_pid_controller;
+			else if (strcmp(optarg, "machine_state_model_controller") == 0) decision_f = machine_state_model_controller;
+			else if (strcmp(optarg, "machine_state_mpc_controller") == 0) decision_f = machine_state_mpc_controller;
+			else if (strcmp(optarg, "machine_state_power_cap_controller") == 0) decision_f = machine_state_power_cap_controller;
+			else if (strcmp(optarg, "machine_state_deadline_controller") == 0) decision_f = machine_state_deadline_controller;
+			else if (strcmp(optarg, "cascaded_controller") == 0) decision_f = cascaded_controller;
+			else if (strcmp(optarg, "calibrate") == 0) decision_f = calibrate;
 			else {
 				fprintf(stderr, "%s: unknown decision function\n", argv[0]);
 				exit(1);
 			}
 			break;
+		case 'o':
+			core_policy = topology_policy(optarg);
+			fail_if(core_policy < 0, "unknown core allocation policy");
+			break;
 		case 'p':
 			if (sscanf(optarg, "%lf", &param1) < 1) {
 				fprintf(stderr, "%s: bad param\n", argv[0]);
@@ -676,10 +2223,69 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 's':
+			sysfs_root = optarg;
+			break;
+		case 'T':
+			/* at least a nanosecond, and no nan or inf: the timer wants a whole number of ns */
+			if (sscanf(optarg, "%lf", &control_period) < 1 || !(control_period * 1e6 >= 1 && control_period * 1e6 < (double)INT64_MAX)) {
+				fprintf(stderr, "%s: bad control period\n", argv[0]);
+				exit(1);
+			}
+			break;
+		case 't':
+			if (sscanf(optarg, "%lf", &dither_quantum) < 1 || dither_quantum <= 0) {
+				fprintf(stderr, "%s: bad dither quantum\n", argv[0]);
+				exit(1);
+			}
+			break;
+		case 'a':
+			async = 1;
+			break;
+		case 'l':
+			latency_file = optarg;
+			break;
+		case 'c':
+			state_cache_file = optarg;
+			break;
+		case 'C':
+			state_cache_file = NULL;
+			break;
+		case 'e':
+			powercap_root = optarg;
+			break;
+		case 'f':
+			state_table_file = optarg;
+			break;
+		case 'k':
+			calibration_file = optarg;
+			break;
+		case 'K':
+			estimate_rate = 1;
+			break;
+		case 'r':
+			phase_reset = 1;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%lf,%lf,%lf,%lf", &pid_gains[0], &pid_gains[1], &pid_gains[2], &pid_gains[3]) < 3) {
+				fprintf(stderr, "%s: bad gains\n", argv[0]);
+				exit(1);
+			}
+			break;
+		case 'j':
+			if (sscanf(optarg, "%d", &machine_state_threads) < 1 || machine_state_threads < 1) {
+				fprintf(stderr, "%s: bad thread count\n", argv[0]);
+				exit(1);
+			}
+			break;
 		default:
-			fprintf(stderr, "Usage: %s [-d decision_function]\n", argv[0]);
+			fprintf(stderr, "Usage: %s [-a] [-c state_cache | -C] [-d decision_function] [-e powercap_root] [-f state_file] [-g Kp,Ki,Kd[,N]] [-j threads] [-k calibration_file] [-K] [-l latency_file] [-o linear|compact|spread|nosmt] [-p param1] [-q param2] [-r] [-s sysfs_root] [-t dither_quantum_ms] [-T control_period_ms]\n", argv[0]);
 			exit(1);
 	}	
+	if (decision_f == calibrate && !calibration_file) {
+		fprintf(stderr, "%s: calibrate needs -k calibration_file\n", argv[0]);
+		exit(1);
+	}
 	argc -= optind;
 	argv += optind;	
 	if (argc > 1) {
@@ -696,10 +2302,19 @@ int main(int argc, char **argv)
 	fail_if(n_apps != 1, "this service only supports a single app. please delete c:\\system32");
 	printf("monitoring process %d\n", apps[0]);
 	
+	/* which cores to hand out first; without a topology we count /proc/cpuinfo and go in order */
+	if (topology_read(&topology, sysfs_root) == 0)
+		topology_set_policy(&topology, core_policy);
+	else
+		fail_if(core_policy != TOPOLOGY_LINEAR, "cannot read cpu topology for the allocation policy");
+	
 	/* initrogenizing old river control structure */
 	core_count = get_core_count();
 	actuator_count = core_count + 3;
 	
+	err = cpufreq_sysfs_open(&cpufreq_fds, sysfs_root, core_count);
+	fail_if(err, "cannot open cpufreq sysfs files");
+	
 	controls = malloc(sizeof(actuator_t) * actuator_count);
 	fail_if(!controls, "could not allocate actuators");
 	/* PROBLEM!!!!! the machine speed actuator needs to init last, but act first! WHAT NOW */
@@ -720,11 +2335,27 @@ int main(int argc, char **argv)
 	err = controls[0].init_f(&controls[0]);
 	fail_if(err, "cannot initialize actuator");
 	
+	if (dither_quantum > 0) {
+		err = dither_start(&controls[0], dither_quantum * 1e6);
+		fail_if(err, "cannot start dithering");
+	}
+	if (async) {
+		err = actuation_queue_start(&queue, actuator_count, controls);
+		fail_if(err, "cannot start asynchronous actuation");
+	}
+	if (latency_file) {
+		err = latency_init(actuator_count);
+		fail_if(err, "cannot set up latency instrumentation");
+	}
+	
 	/* begin monitoration of lone protoss */
 	err = heart_rate_monitor_init(&hrm, apps[0]);
 	fail_if(err, "cannot start heart rate monitor");
 	
 	window_size = hrm_get_window_size(&hrm);
+	/* at a phase change, the app's window forgets the old phase, so we don't have to wait it out */
+	if (phase_reset) hrm_set_phase_reset(&hrm, 1);
+	phase = hrm_get_phase(&hrm, NULL);
 	current.beat = -1;
 	skip_until_beat = window_size;
 	
@@ -748,13 +2379,57 @@ int main(int argc, char **argv)
 	}
 	printf("\n");
 
+	if (control_period > 0) {
+		err = control_timer_start(&control_timer, control_period * 1e6);
+		fail_if(err, "cannot start control timer");
+	}
+	
 	do {
-		do {
+		if (control_period > 0) {
+			err = control_timer_tick(&control_timer, &current);
+			fail_if(err < 0, "cannot wait for control timer");
+			if (err == 0) continue;
+		} else do {
 			err = hrm_get_current(&hrm, &current);
 		} while (err || current.beat <= last_beat || current.window_rate == 0.0);
 
 		last_beat = current.beat;
-		if (current.beat < skip_until_beat) {
+		if (async) {
+			was_in_flight = in_flight;
+			in_flight = actuation_queue_sync(&queue, controls);
+			if (in_flight == 0)
+				controls[0].value = get_current_speed(&controls[0]);
+		}
+		if (latency_file)
+			latency_beat(&current, actuator_count, controls);
+		if (machine_speed_observe(&controls[0]) < 0)
+			fprintf(stderr, "cannot update the power model: %s\n", strerror(errno));
+		/* an asynchronous actuation only starts the wait from the beat it was applied at */
+		if (async && was_in_flight && !in_flight) {
+			if (estimate_rate) {
+				rate_estimator.pending = 1;
+				settle_until_beat = current.beat + window_size;
+				skip_until_beat = current.beat + 1;
+			} else
+				skip_until_beat = current.beat + applied_wait;
+			if (control_period > 0)
+				control_timer_acted(&control_timer);
+		}
+		if (phase_reset && hrm_get_phase(&hrm, NULL) != phase) {
+			phase = hrm_get_phase(&hrm, NULL);
+			rate_estimator.started = 0;
+			if (skip_until_beat > current.beat + 1) skip_until_beat = current.beat + 1;
+		}
+		if (estimate_rate) {
+			rate_estimator_update(&rate_estimator, &current, actuator_count, controls);
+			/* the decision functions get the estimate where they used to get the window average */
+			if (rate_estimator.started) current.window_rate = rate_estimator.k.x;
+			/* after an actuation, wait for the estimate to settle, but never longer than a window */
+			if (current.beat < settle_until_beat && !rate_estimate_settled(&rate_estimator))
+				skip_until_beat = current.beat + 1;
+		}
+		/* deciding again while the last decision is still being applied would judge it by the old state */
+		if (in_flight || (control_period > 0 ? control_timer_holding(&control_timer) : current.beat < skip_until_beat)) {
 			print_status(&current, skip_until_beat, '.', actuator_count, controls);
 			continue;
 		}
@@ -762,30 +2437,65 @@ int main(int argc, char **argv)
 		/*printf("Current beat: %lld, tag: %d, window: %lld, window_rate: %f\n",
 			   current.beat, current.tag, window_size, current.window_rate);*/
 		
+		decision_time = get_time_ns();
+		decision_wait = 0;
 		decision_f(&current, actuator_count, controls, param1, param2);
 		
 		acted = 0;
 		for (i = 0; i < actuator_count; i++) {
 			actuator_t *act = &controls[i];
+			if (dithered(act)) continue;
+			if (latency_file && act->set_value != act->value)
+				latency_actuated(i, act->set_value, decision_time);
+			if (async && runs_async(act)) continue;
 			if (act->set_value != act->value) {
 #if DEBUG
 				printf("act %d: %d -> %d\n", i, act->value, act->set_value);
 #endif
 				err = act->action_f(act);	/* TODO: handle error */
 				if (err) fprintf(stderr, "action %d failed: %s\n", act->id, strerror(errno));
+				act->applied_time = get_time_ns();
 				acted = 1;
 			}
 		}
+		if (async) {
+			/* the worker reports back through actuation_queue_sync; until then assume we get what we asked for */
+			in_flight = actuation_queue_post(&queue, controls);
+			acted = in_flight > 0;
+			if (controls[0].value != controls[0].set_value)
+				controls[0].value = controls[0].set_value;
+		}
 		/* this is horrible but necessary due to time constraints: update speed actuator's value */
-		if (controls[0].value != controls[0].set_value)
+		else if (controls[0].value != controls[0].set_value)
 			controls[0].value = get_current_speed(&controls[0]);
 
-		skip_until_beat = current.beat + (acted ? window_size : 1);
+		if (acted && machine_speed_observe(&controls[0]) < 0)
+			fprintf(stderr, "cannot update the power model: %s\n", strerror(errno));
+		if (async && acted) {
+			/* held until it's applied, see above */
+			applied_wait = decision_wait > 0 ? decision_wait : window_size;
+			skip_until_beat = current.beat + 1;
+		} else if (estimate_rate && acted) {
+			rate_estimator.pending = 1;
+			settle_until_beat = current.beat + window_size;
+			skip_until_beat = current.beat + 1;
+		} else
+			skip_until_beat = current.beat + (acted ? (decision_wait > 0 ? decision_wait : window_size) : 1);
+		if (control_period > 0 && acted && !async)
+			control_timer_acted(&control_timer);
 		
 		print_status(&current, skip_until_beat, acted ? '*' : '=', actuator_count, controls);
-	} while (current.beat < max_beats);
+	} while (current.beat < max_beats && !stop_requested);
 	
+	if (async) actuation_queue_stop(&queue);
+	dither_stop();
+	frontier_rebuild_stop(&frontier_rebuild);
+	control_timer_stop(&control_timer);
+	if (latency_file && latency_export(latency_file, actuator_count, controls))
+		fprintf(stderr, "%s: could not write latency file\n", argv[0]);
 	heart_rate_monitor_finish(&hrm);
+	cpufreq_sysfs_close(&cpufreq_fds);
+	topology_free(&topology);
 	
 	return 0;
 fail:
@@ -0,0 +1,215 @@
+/*
+ *  cpufreq_sysfs.c
+ *  heartbeats
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "cpufreq_sysfs.h"
+
+#define fail_if(exp, msg) do { if ((exp)) { fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, (msg), strerror(errno)); goto fail; } } while (0)
+
+/* scaling_setspeed only exists with the userspace governor; otherwise pin the max */
+static int open_set_fd(const char *root, int cpu)
+{
+	char path[PATH_MAX];
+	int fd;
+	
+	snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/scaling_setspeed", root, cpu);
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/scaling_max_freq", root, cpu);
+		fd = open(path, O_WRONLY);
+	}
+	return fd;
+}
+
+/* libcpufreq opens and closes the sysfs file on every call and then retries through /proc,
+ which masks the original errno. we open everything once and just pwrite into it. */
+int cpufreq_sysfs_open(cpufreq_sysfs_t *cs, const char *root, int cpu_count)
+{
+	int cpu;
+	
+	if (!root) root = CPUFREQ_SYSFS_DEFAULT_ROOT;
+	cs->root = root;
+	cs->cpu_count = cpu_count;
+	cs->fds = malloc(sizeof(int) * cpu_count);
+	fail_if(!cs->fds, "cannot allocate cpufreq fd array");
+	for (cpu = 0; cpu < cpu_count; cpu++)
+		cs->fds[cpu] = -1;
+	
+	for (cpu = 0; cpu < cpu_count; cpu++) {
+		cs->fds[cpu] = open_set_fd(root, cpu);
+		fail_if(cs->fds[cpu] < 0, "cannot open cpufreq sysfs file");
+	}
+	return 0;
+fail:
+	cpufreq_sysfs_close(cs);
+	return -1;
+}
+
+void cpufreq_sysfs_close(cpufreq_sysfs_t *cs)
+{
+	int cpu;
+	
+	if (!cs->fds) return;
+	for (cpu = 0; cpu < cs->cpu_count; cpu++)
+		if (cs->fds[cpu] >= 0) close(cs->fds[cpu]);
+	free(cs->fds);
+	cs->fds = NULL;
+}
+
+static int write_freq(int fd, const char *buf, int len)
+{
+	return pwrite(fd, buf, len, 0) == len ? 0 : -1;
+}
+
+int cpufreq_sysfs_set(cpufreq_sysfs_t *cs, int cpu, unsigned long freq)
+{
+	char buf[32];
+	int len;
+	
+	if (cpu < 0 || cpu >= cs->cpu_count) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = snprintf(buf, sizeof(buf), "%lu", freq);
+	return write_freq(cs->fds[cpu], buf, len);
+}
+
+/* one pass over all cpus; keeps going after a failure and reports the first errno */
+int cpufreq_sysfs_set_all(cpufreq_sysfs_t *cs, unsigned long freq)
+{
+	char buf[32];
+	int len, cpu;
+	int err = 0, saved_errno = 0;
+	
+	len = snprintf(buf, sizeof(buf), "%lu", freq);
+	for (cpu = 0; cpu < cs->cpu_count; cpu++) {
+		if (write_freq(cs->fds[cpu], buf, len) && !err) {
+			err = -1;
+			saved_errno = errno;
+		}
+	}
+	if (err) errno = saved_errno;
+	return err;
+}
+
+/* the scheduler's idea of how fast a cpu is at its top frequency (1024 for the biggest cores), which is
+ only there on asymmetric machines; returns 0 if there is none */
+unsigned long cpufreq_sysfs_capacity(cpufreq_sysfs_t *cs, int cpu)
+{
+	char path[PATH_MAX];
+	unsigned long capacity = 0;
+	FILE *f;
+	
+	snprintf(path, sizeof(path), "%s/cpu%d/cpu_capacity", cs->root, cpu);
+	f = fopen(path, "r");
+	if (!f) return 0;
+	if (fscanf(f, "%lu", &capacity) != 1) capacity = 0;
+	fclose(f);
+	return capacity;
+}
+
+static int compare_freqs(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	
+	return x < y ? -1 : x > y;
+}
+
+/* a cpu's scaling_available_frequencies, lowest first, in a malloced array; returns how many, or -1 */
+int cpufreq_sysfs_frequencies(cpufreq_sysfs_t *cs, int cpu, unsigned long **freqs)
+{
+	char path[PATH_MAX];
+	unsigned long freq, *f = NULL, *bigger;
+	int count = 0, size = 0;
+	FILE *file;
+	
+	snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/scaling_available_frequencies", cs->root, cpu);
+	file = fopen(path, "r");
+	fail_if(!file, "cannot open frequency list");
+	while (fscanf(file, "%lu", &freq) == 1) {
+		if (count == size) {
+			size = size ? size * 2 : 16;
+			bigger = realloc(f, sizeof(unsigned long) * size);
+			fail_if(!bigger, "cannot allocate frequency list");
+			f = bigger;
+		}
+		f[count++] = freq;
+	}
+	fclose(file);
+	file = NULL;
+	if (count == 0) errno = ENOENT;
+	fail_if(count == 0, "empty frequency list");
+	qsort(f, count, sizeof(unsigned long), compare_freqs);
+	*freqs = f;
+	return count;
+fail:
+	if (file) fclose(file);
+	free(f);
+	return -1;
+}
+
+/* a number from cpuN/cpufreq/name, e.g. cpuinfo_max_freq or scaling_cur_freq */
+int cpufreq_sysfs_read(cpufreq_sysfs_t *cs, int cpu, const char *name, unsigned long *value)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ok;
+	
+	snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/%s", cs->root, cpu, name);
+	f = fopen(path, "r");
+	if (!f) return -1;
+	ok = fscanf(f, "%lu", value) == 1;
+	fclose(f);
+	if (!ok) errno = EINVAL;
+	return ok ? 0 : -1;
+}
+
+/* switches a cpu to a governor unless it already has it, and checks that it took. the cpu's write
+ fd is reopened, since scaling_setspeed comes and goes with the userspace governor */
+int cpufreq_sysfs_set_governor(cpufreq_sysfs_t *cs, int cpu, const char *governor)
+{
+	char path[PATH_MAX], current[64];
+	FILE *f;
+	int fd, len = strlen(governor);
+	
+	snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/scaling_governor", cs->root, cpu);
+	f = fopen(path, "r");
+	fail_if(!f, "cannot read cpufreq governor");
+	if (fscanf(f, "%63s", current) != 1) current[0] = '\0';
+	fclose(f);
+	if (strcmp(current, governor) == 0) return 0;
+	
+	fd = open(path, O_WRONLY);
+	fail_if(fd < 0, "cannot open cpufreq governor");
+	if (write(fd, governor, len) != len) {
+		close(fd);
+		fail_if(1, "cannot set cpufreq governor");
+	}
+	close(fd);
+	f = fopen(path, "r");
+	fail_if(!f, "cannot read cpufreq governor");
+	if (fscanf(f, "%63s", current) != 1) current[0] = '\0';
+	fclose(f);
+	if (strcmp(current, governor) != 0) errno = EINVAL;
+	fail_if(strcmp(current, governor) != 0, "cpufreq governor did not change");
+	
+	if (cs->fds && cpu >= 0 && cpu < cs->cpu_count) {
+		fd = open_set_fd(cs->root, cpu);
+		fail_if(fd < 0, "cannot open cpufreq sysfs file");
+		close(cs->fds[cpu]);
+		cs->fds[cpu] = fd;
+	}
+	return 0;
+fail:
+	return -1;
+}
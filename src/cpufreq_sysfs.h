@@ -0,0 +1,23 @@
+/*
+ *  cpufreq_sysfs.h
+ *  heartbeats
+ *
+ */
+
+#define CPUFREQ_SYSFS_DEFAULT_ROOT "/sys/devices/system/cpu"
+
+/* one write fd per cpu, opened once and kept for the lifetime of the controller */
+typedef struct cpufreq_sysfs {
+	const char *root;
+	int cpu_count;
+	int *fds;
+} cpufreq_sysfs_t;
+
+int cpufreq_sysfs_open(cpufreq_sysfs_t *cs, const char *root, int cpu_count);
+void cpufreq_sysfs_close(cpufreq_sysfs_t *cs);
+int cpufreq_sysfs_set(cpufreq_sysfs_t *cs, int cpu, unsigned long freq);
+int cpufreq_sysfs_set_all(cpufreq_sysfs_t *cs, unsigned long freq);
+unsigned long cpufreq_sysfs_capacity(cpufreq_sysfs_t *cs, int cpu);
+int cpufreq_sysfs_frequencies(cpufreq_sysfs_t *cs, int cpu, unsigned long **freqs);
+int cpufreq_sysfs_read(cpufreq_sysfs_t *cs, int cpu, const char *name, unsigned long *value);
+int cpufreq_sysfs_set_governor(cpufreq_sysfs_t *cs, int cpu, const char *governor);
@@ -145,3 +145,25 @@ int64_t hrm_get_window_size(heart_rate_monitor_t volatile * hb) {
   return hb->state->window_size;
 }
 
+
+/**
+       * Returns how many phase changes the application has gone through
+       * @param hb pointer to heart_rate_monitor_t
+       * @param phase_beat if not NULL, receives the first beat of the current phase
+       * @return the number of phase changes (int64_t)
+       */
+int64_t hrm_get_phase(heart_rate_monitor_t volatile * hb, int64_t * phase_beat) {
+  if(phase_beat != NULL)
+    *phase_beat = hb->state->phase_beat;
+  return hb->state->phase_count;
+}
+
+/**
+       * Asks the application to drop the intervals before a phase change
+       * from its windowed rate, instead of averaging across the boundary
+       * @param hb pointer to heart_rate_monitor_t
+       * @param reset integer, non-zero to enable
+       */
+void hrm_set_phase_reset(heart_rate_monitor_t volatile * hb, int reset) {
+  hb->state->phase_reset = reset != 0;
+}
@@ -2,6 +2,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* phase change detection on inter-beat intervals; see changepoint.h. a 10% drift is noise, and
+ a sustained 50% change is caught in about 5 beats. override with DEFINES */
+#ifndef HB_PHASE_DELTA
+#define HB_PHASE_DELTA 0.1
+#endif
+#ifndef HB_PHASE_THRESHOLD
+#define HB_PHASE_THRESHOLD 2.0
+#endif
+
 /**
        * Helper function for allocating shared memory
        */
@@ -115,6 +124,11 @@ int heartbeat_init(heartbeat_t* hb,
   pthread_mutex_init(&hb->mutex, NULL);
   hb->steady_state = 0;
   hb->state->valid = 0;
+  hb->state->phase_count = 0;
+  hb->state->phase_beat = 0;
+  hb->state->phase_time = -1;
+  hb->state->phase_reset = 0;
+  changepoint_init(&hb->phase_detector, HB_PHASE_DELTA, HB_PHASE_THRESHOLD);
 
   hb->binary_file = fopen(hb->filename, "w");
   if ( hb->binary_file == NULL ) {
@@ -236,6 +250,79 @@ int64_t hb_get_window_size(heartbeat_t volatile * hb) {
   return hb->state->window_size;
 }
 
+/**
+       * Returns how many phase changes the application has gone through
+       * @param hb pointer to heartbeat_t
+       * @param phase_beat if not NULL, receives the first beat of the current phase
+       * @return the number of phase changes (int64_t)
+       */
+int64_t hb_get_phase(heartbeat_t volatile * hb, int64_t * phase_beat) {
+  if(phase_beat != NULL)
+    *phase_beat = hb->state->phase_beat;
+  return hb->state->phase_count;
+}
+
+static void hb_reverse(int64_t * a, int64_t n) {
+  int64_t i, t;
+
+  for(i = 0; i < n / 2; i++) {
+    t = a[i];
+    a[i] = a[n - 1 - i];
+    a[n - 1 - i] = t;
+  }
+}
+
+/**
+       * Helper function to restart the window with only
+       * its newest intervals
+       * @param hb pointer to heartbeat_t
+       * @param keep int64_t
+       */
+static void hb_window_restart(heartbeat_t volatile * hb, 
+			      int64_t keep) {
+  int64_t count = hb->steady_state ? hb->state->window_size : hb->current_index;
+
+  if(keep > count)
+    keep = count;
+  /* the next interval must still fit */
+  if(keep > hb->state->window_size - 1)
+    keep = hb->state->window_size - 1;
+  if(keep < 0)
+    keep = 0;
+
+  if(hb->steady_state) {
+    /* rotate the ring into oldest-first order */
+    hb_reverse(hb->window, hb->current_index);
+    hb_reverse(hb->window + hb->current_index, count - hb->current_index);
+    hb_reverse(hb->window, count);
+  }
+  memmove(hb->window, hb->window + count - keep, keep * sizeof(int64_t));
+  hb->current_index = keep;
+  hb->steady_state = 0;
+}
+
+/**
+       * Helper function to track phase changes
+       * @param hb pointer to heartbeat_t
+       * @param interval int64_t
+       * @param time int64_t
+       */
+static inline void hb_phase_update(heartbeat_t volatile * hb, 
+				   int64_t interval,
+				   int64_t time) {
+  changepoint_t *cp = (changepoint_t *) &hb->phase_detector;
+  int64_t beat = hb->state->counter;
+
+  if(changepoint_update(cp, (double) interval, beat, time) == 0)
+    return;
+  hb->state->phase_beat = cp->onset_beat;
+  hb->state->phase_time = cp->onset_time;
+  hb->state->phase_count++;
+  /* the intervals from the onset on (minus this one, which is about to be added) are the new phase */
+  if(hb->state->phase_reset)
+    hb_window_restart(hb, beat - cp->onset_beat);
+}
+
 /**
        * Helper function to compute windowed heart rate
        * @param hb pointer to heartbeat_t
@@ -349,6 +436,7 @@ int64_t heartbeat( heartbeat_t* hb, int tag )
       //printf("In heartbeat - NOT first time stamp - read index = %d\n",hb->state->read_index );
       int index =  hb->state->buffer_index;
       hb->last_timestamp = time;
+      hb_phase_update(hb, time-old_last_time, time);
       double window_heartrate = hb_window_average(hb, time-old_last_time);
       double global_heartrate = 
 	(((double) hb->state->counter+1) / 
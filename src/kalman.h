@@ -0,0 +1,43 @@
+/*
+ *  kalman.h
+ *  heartbeats
+ *
+ */
+
+#ifndef _KALMAN_H_
+#define _KALMAN_H_
+
+/* scalar Kalman filter for a quantity that drifts as a random walk. that's all a heart rate or
+ the rate of one machine state is to us, so no matrices. header-only, like changepoint.h. */
+
+typedef struct kalman {
+	double x;	/* estimate */
+	double p;	/* its variance */
+	double q;	/* drift variance added per step */
+	double r;	/* measurement noise variance */
+} kalman_t;
+
+static inline void kalman_init(kalman_t *k, double x, double p, double q, double r)
+{
+	k->x = x;
+	k->p = p;
+	k->q = q;
+	k->r = r;
+}
+
+static inline void kalman_predict(kalman_t *k)
+{
+	k->p += k->q;
+}
+
+/* folds in one measurement and returns the new estimate */
+static inline double kalman_update(kalman_t *k, double z)
+{
+	double gain = k->p / (k->p + k->r);
+	
+	k->x += gain * (z - k->x);
+	k->p *= 1.0 - gain;
+	return k->x;
+}
+
+#endif
@@ -13,84 +13,685 @@
 #include <limits.h>
 #include <unistd.h>
 #include <cpufreq.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "machine_states.h"
 
 #define fail_if(exp, msg) do { if ((exp)) { fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, (msg), strerror(errno)); goto fail; } } while (0)
 
-/* square-and-multiply, lol */
-static int ipow(int base, int exp)
+/* bump this whenever calculate_state_properties changes, so cached frontiers built with the old model are rebuilt */
+#define POWER_MODEL_VERSION 1
+
+/* machine models */
+
+int machine_model_init(machine_model_t *model, int core_count)
+{
+	memset(model, 0, sizeof(*model));
+	model->core_count = core_count;
+	model->classes = calloc(core_count, sizeof(core_class_t));	/* never more classes than cores */
+	model->core_class = calloc(core_count, sizeof(int));
+	fail_if(!model->classes || !model->core_class, "cannot allocate machine model");
+	return 0;
+fail:
+	machine_model_free(model);
+	return -1;
+}
+
+/* every core has the same frequencies and the default coefficients */
+int machine_model_init_uniform(machine_model_t *model, int core_count, int freq_count, unsigned long *freq_array)
 {
-	int result = 1;
-	while (exp) {
-		if (exp & 0x01) result *= base;
-		exp >>= 1;
-		base *= base;
+	if (machine_model_init(model, core_count)) return -1;
+	if (machine_model_add_class(model, freq_count, freq_array, CORE_SCALE_UNIT, CORE_SCALE_UNIT, DEFAULT_STATIC_POWER) < 0) {
+		machine_model_free(model);
+		return -1;
 	}
-	return result;
+	return 0;
+}
+
+void machine_model_free(machine_model_t *model)
+{
+	int k;
+	
+	for (k = 0; k < model->class_count; k++)
+		free(model->classes[k].freqs);
+	free(model->classes);
+	free(model->core_class);
+	memset(model, 0, sizeof(*model));
+}
+
+/* returns the index of the new class; cores start out in class 0 */
+int machine_model_add_class(machine_model_t *model, int freq_count, unsigned long *freq_array, unsigned long speed_scale, unsigned long power_scale, unsigned long static_power)
+{
+	core_class_t *class;
+	
+	if (model->class_count >= model->core_count) {
+		errno = EINVAL;
+		fail_if(1, "more core classes than cores");
+	}
+	class = &model->classes[model->class_count];
+	class->freqs = malloc(sizeof(unsigned long) * (freq_count > 0 ? freq_count : 1));
+	fail_if(!class->freqs, "cannot allocate core class");
+	memcpy(class->freqs, freq_array, sizeof(unsigned long) * freq_count);
+	class->freq_count = freq_count;
+	class->speed_scale = speed_scale;
+	class->power_scale = power_scale;
+	class->static_power = static_power;
+	return model->class_count++;
+fail:
+	return -1;
+}
+
+void machine_model_set_class(machine_model_t *model, int core, int class_index)
+{
+	model->core_class[core] = class_index;
 }
 
+/* for working on a model while its owner keeps changing the coefficients */
+int machine_model_copy(machine_model_t *dst, machine_model_t *src)
+{
+	int k;
+	core_class_t *class;
+	
+	if (machine_model_init(dst, src->core_count)) return -1;
+	for (k = 0; k < src->class_count; k++) {
+		class = &src->classes[k];
+		if (machine_model_add_class(dst, class->freq_count, class->freqs, class->speed_scale, class->power_scale, class->static_power) < 0) {
+			machine_model_free(dst);
+			return -1;
+		}
+	}
+	memcpy(dst->core_class, src->core_class, sizeof(int) * src->core_count);
+	return 0;
+}
+
+static const core_class_t default_core = { .speed_scale = CORE_SCALE_UNIT, .power_scale = CORE_SCALE_UNIT, .static_power = DEFAULT_STATIC_POWER };
+
 /* completely made up! */
-void calculate_state_properties(unsigned long *state, int core_count)
+static void state_properties(unsigned long *state, int core_count, const core_class_t *classes, const int *core_class)
 {
-	unsigned long speed = 0, power = 0;
+	unsigned long long speed = 0, power = 0, freq;
+	const core_class_t *class = &default_core;
 	int i;
 	
+	/* summed in thousandths, so the coefficients don't cost precision */
 	for (i = 0; i < core_count; i++) {
-		speed += state[CORE_IDX(i)];
-		power += (state[CORE_IDX(i)] > 0 ? 1000000 : 0) + state[CORE_IDX(i)];
+		if (core_class) class = &classes[core_class[i]];
+		freq = state[CORE_IDX(i)];
+		speed += freq * class->speed_scale;
+		power += (freq > 0 ? (unsigned long long)class->static_power * CORE_SCALE_UNIT : 0) + freq * class->power_scale;
 	}
-	state[SPEED_IDX] = speed / 10000;
-	state[POWER_IDX] = power / 10000;
+	state[SPEED_IDX] = speed / (10000ULL * CORE_SCALE_UNIT);
+	state[POWER_IDX] = power / (10000ULL * CORE_SCALE_UNIT);
 }
 
-static void generate_machine_states_internal(unsigned long **state_cursor, unsigned long *state, int core_count, int freq_count, unsigned long *freq_array, int core)
+/* a machine of identical cores with the default coefficients */
+void calculate_state_properties(unsigned long *state, int core_count)
 {
-	int i;
-	for (i = 0; i <= freq_count; i++) {
-		state[CORE_IDX(core)] = (i == freq_count ? 0 : freq_array[i]);
-		if (core == core_count - 1) {
-			calculate_state_properties(state, core_count);
-			memcpy(*state_cursor, state, STATE_SIZE(core_count));
-			(*state_cursor) += STATE_LEN(core_count);
-		} else generate_machine_states_internal(state_cursor, state, core_count, freq_count, freq_array, core + 1);
+	state_properties(state, core_count, NULL, NULL);
+}
+
+void machine_model_state_properties(machine_model_t *model, unsigned long *state)
+{
+	state_properties(state, model->core_count, model->classes, model->core_class);
+}
+
+/* state generation */
+
+static int compare_freqs_descending(const void *a, const void *b)
+{
+	unsigned long fa = *(const unsigned long *)a, fb = *(const unsigned long *)b;
+	return fa > fb ? -1 : fa < fb;
+}
+
+typedef struct enumeration {
+	machine_model_t *model;
+	int monotone;
+	unsigned long **freqs;	/* per class; sorted by decreasing frequency when monotone */
+	int *first;	/* per class: the lowest frequency index the next core of that class may take */
+	state_consumer_t consumer;
+	void *ctx;
+} enumeration_t;
+
+static void enumeration_free(enumeration_t *e)
+{
+	int k;
+	
+	if (e->freqs)
+		for (k = 0; k < e->model->class_count; k++)
+			free(e->freqs[k]);
+	free(e->freqs);
+	free(e->first);
+}
+
+static int enumeration_init(enumeration_t *e, machine_model_t *model, int monotone, state_consumer_t consumer, void *ctx)
+{
+	core_class_t *class;
+	int k;
+	
+	*e = (enumeration_t) { .model = model, .monotone = monotone, .consumer = consumer, .ctx = ctx };
+	e->freqs = calloc(model->class_count, sizeof(unsigned long *));
+	e->first = calloc(model->class_count, sizeof(int));
+	fail_if(!e->freqs || !e->first, "cannot allocate state enumeration buffers");
+	for (k = 0; k < model->class_count; k++) {
+		class = &model->classes[k];
+		e->freqs[k] = malloc(sizeof(unsigned long) * (class->freq_count > 0 ? class->freq_count : 1));
+		fail_if(!e->freqs[k], "cannot allocate state enumeration buffers");
+		memcpy(e->freqs[k], class->freqs, sizeof(unsigned long) * class->freq_count);
+		if (monotone) qsort(e->freqs[k], class->freq_count, sizeof(unsigned long), compare_freqs_descending);
 	}
+	return 0;
+fail:
+	enumeration_free(e);
+	return -1;
 }
 
-unsigned long *create_machine_states(int *state_count, int core_count, int freq_count, unsigned long *freq_array)
+static int enumerate_internal(enumeration_t *e, unsigned long *state, int core)
 {
-	unsigned long *states, *state, *statecursor;
+	machine_model_t *model = e->model;
+	int k = model->core_class[core], freq_count = model->classes[k].freq_count;
+	int i, first = 0, saved = e->first[k], err = 0;
 	
-	*state_count = ipow(freq_count + 1, core_count);	/* we add freq 0 to represent the core being off */
-	state = malloc(STATE_SIZE(core_count));
-	statecursor = states = malloc(STATE_SIZE(core_count) * *state_count);
-	generate_machine_states_internal(&statecursor, state, core_count, freq_count, freq_array, 0);
+	if (e->monotone) {
+		first = saved;
+		/* the core count actuator turns cores off from the end, so the cores that are on come first */
+		if (core > 0 && state[CORE_IDX(core - 1)] == 0) first = freq_count;
+	}
+	for (i = first; i <= freq_count && !err; i++) {
+		state[CORE_IDX(core)] = (i == freq_count ? 0 : e->freqs[k][i]);	/* we add freq 0 to represent the core being off */
+		e->first[k] = i;
+		if (core == model->core_count - 1) {
+			machine_model_state_properties(model, state);
+			err = e->consumer(state, model->core_count, e->ctx);
+		} else err = enumerate_internal(e, state, core + 1);
+	}
+	e->first[k] = saved;
+	return err;
+}
+
+/* hands every state to the consumer, without ever building the full product. when monotone, only the
+ states whose frequencies are non-increasing from core to core within each class, and whose cores that
+ are on come first. the state passed in is scratch space: the consumer must copy it if it wants to keep
+ it. stops early if the consumer returns non-zero. */
+static int enumerate_states(machine_model_t *model, int monotone, state_consumer_t consumer, void *ctx)
+{
+	enumeration_t e;
+	unsigned long *state;
+	int err;
+	
+	state = malloc(STATE_SIZE(model->core_count));
+	fail_if(!state, "cannot allocate state enumeration buffer");
+	err = enumeration_init(&e, model, monotone, consumer, ctx);
+	if (!err) {
+		err = enumerate_internal(&e, state, 0);
+		enumeration_free(&e);
+	}
 	free(state);
-	return states;
+	return err;
+fail:
+	return -1;
+}
+
+/* number of multisets of core_count elements out of freq_count+1 (off counts as a frequency): C(f+c, c),
+ or ULONG_MAX if that doesn't fit */
+unsigned long monotone_state_count(int core_count, int freq_count)
+{
+	unsigned long n = 1;
+	int i;
+	
+	for (i = 1; i <= core_count; i++) {
+		if (n > ULONG_MAX / (freq_count + i)) return ULONG_MAX;
+		n = n * (freq_count + i) / i;	/* n is C(f+i, i) at the end of each step, so this divides exactly */
+	}
+	return n;
 }
 
-int compare_states_on_speed(const void *a, const void *b)
+/* an upper bound on how many states an enumeration of the model hands out, to check before starting one
+ that would never end: all of them, permutations included, are the product of (freq_count+1) over the
+ cores. saturates at ULONG_MAX. */
+unsigned long machine_model_state_count(machine_model_t *model, int monotone)
 {
-	const unsigned long *sa = a;
-	const unsigned long *sb = b;
+	unsigned long n = 1, class_n;
+	int k, core, cores;
+	
+	for (k = 0; k < model->class_count; k++) {
+		for (cores = 0, core = 0; core < model->core_count; core++)
+			if (model->core_class[core] == k) cores++;
+		if (monotone) class_n = monotone_state_count(cores, model->classes[k].freq_count);
+		else for (class_n = 1; cores > 0; cores--) {
+			if (class_n > ULONG_MAX / (model->classes[k].freq_count + 1)) return ULONG_MAX;
+			class_n *= model->classes[k].freq_count + 1;
+		}
+		if (n > ULONG_MAX / class_n) return ULONG_MAX;
+		n *= class_n;
+	}
+	return n;
+}
+
+/* threads */
+
+typedef void *(*job_f) (void *job);
 
-	if (sa[SPEED_IDX] < sb[SPEED_IDX]) return -1;
-	if (sa[SPEED_IDX] > sb[SPEED_IDX]) return 1;
-	/* if the speed is the same, sort by decreasing power */
-	if (sa[POWER_IDX] > sb[POWER_IDX]) return -1;
-	if (sa[POWER_IDX] < sb[POWER_IDX]) return 1;
+/* runs f once per job, each in its own thread; a job whose thread can't be created just runs inline */
+static void run_jobs(job_f f, void *jobs, size_t job_size, int job_count)
+{
+	pthread_t *threads;
+	char *started;
+	int i;
+	
+	threads = malloc(sizeof(pthread_t) * job_count);
+	started = calloc(job_count, 1);
+	for (i = 0; i < job_count; i++) {
+		void *job = (char *)jobs + i * job_size;
+		if (threads && started && pthread_create(&threads[i], NULL, f, job) == 0) started[i] = 1;
+		else f(job);
+	}
+	for (i = 0; i < job_count; i++)
+		if (started && started[i]) pthread_join(threads[i], NULL);
+	free(threads);
+	free(started);
+}
+
+static int clamp_threads(int threads)
+{
+	if (threads > MAX_TABLE_THREADS) return MAX_TABLE_THREADS;
+	return threads > 1 ? threads : 1;
+}
+
+/* splits [0, n) into job_count nearly equal chunks; returns the start of chunk i (chunk job_count is n) */
+static int chunk_start(int n, int job_count, int i)
+{
+	return (int)((long long)n * i / job_count);
+}
+
+/* packed state tables */
+/* speed and power live in their own arrays and each core gets a column of one-byte indices into
+ the table's frequency list, so a state costs 16 + core_count bytes instead of 8 * (2 + core_count),
+ and the sort/filter/lookup passes below only ever stream through the two 8-byte columns. */
+
+static int state_table_resize(state_table_t *table, int size)
+{
+	unsigned long *speed, *power;
+	uint8_t *idx;
+	int core;
+	
+	speed = realloc(table->speed, sizeof(unsigned long) * size);
+	if (speed) table->speed = speed;
+	power = realloc(table->power, sizeof(unsigned long) * size);
+	if (power) table->power = power;
+	idx = malloc((size_t)size * table->core_count);
+	fail_if(!speed || !power || !idx, "cannot allocate state table");
+	for (core = 0; core < table->core_count; core++) {
+		if (table->freq_idx[core])
+			memcpy(idx + (size_t)core * size, table->freq_idx[core], table->count);
+		table->freq_idx[core] = idx + (size_t)core * size;
+	}
+	free(table->freq_base);
+	table->freq_base = idx;
+	table->size = size;
 	return 0;
+fail:
+	free(idx);
+	return -1;
+}
+
+int state_table_init(state_table_t *table, int core_count, int size)
+{
+	memset(table, 0, sizeof(*table));
+	table->core_count = core_count;
+	table->threads = 1;
+	table->freq_idx = calloc(core_count, sizeof(uint8_t *));
+	fail_if(!table->freq_idx, "cannot allocate state table");
+	return state_table_resize(table, size > 0 ? size : 1);
+fail:
+	return -1;
+}
+
+void state_table_free(state_table_t *table)
+{
+	free(table->speed);
+	free(table->power);
+	free(table->freq_base);
+	free(table->freq_idx);
+	free(table->core_class);
+	memset(table, 0, sizeof(*table));
+}
+
+/* which cores FILTER_REDUNDANT may swap: the table keeps its own copy, since it outlives the model
+ it was built from (a refitted model is thrown away once its frontier is in) */
+int state_table_set_classes(state_table_t *table, machine_model_t *model)
+{
+	free(table->core_class);
+	table->core_class = NULL;
+	if (model->class_count <= 1) return 0;
+	table->core_class = malloc(sizeof(int) * model->core_count);
+	fail_if(!table->core_class, "cannot allocate state table classes");
+	memcpy(table->core_class, model->core_class, sizeof(int) * model->core_count);
+	return 0;
+fail:
+	return -1;
+}
+
+static int state_table_freq_index(state_table_t *table, unsigned long freq)
+{
+	int i;
+	
+	for (i = 0; i < table->freq_count; i++)
+		if (table->freqs[i] == freq) return i;
+	if (table->freq_count >= MAX_TABLE_FREQS) {
+		errno = ERANGE;
+		return -1;
+	}
+	table->freqs[table->freq_count] = freq;
+	return table->freq_count++;
 }
 
-/* eliminate permutations by requiring that frequencies be monotonically decreasing */
-int redundant_state(unsigned long *state, int core_count)
+/* takes a state in the unpacked row format */
+int state_table_append(state_table_t *table, unsigned long *state)
 {
-	int j;
-	unsigned long last = ULONG_MAX;
+	int core, idx, i = table->count;
 	
-	for (j = 0; j < core_count; j++) {
-		if (state[CORE_IDX(j)] > last) return 1;
-		last = state[CORE_IDX(j)];
+	if (table->count >= table->size)
+		fail_if(state_table_resize(table, table->size * 2), "cannot grow state table");
+	table->speed[i] = state[SPEED_IDX];
+	table->power[i] = state[POWER_IDX];
+	for (core = 0; core < table->core_count; core++) {
+		/* generated states mostly differ from the previous one in the last core or two */
+		if (i > 0 && table->freqs[table->freq_idx[core][i-1]] == state[CORE_IDX(core)])
+			idx = table->freq_idx[core][i-1];
+		else
+			idx = state_table_freq_index(table, state[CORE_IDX(core)]);
+		fail_if(idx < 0, "too many distinct frequencies for a packed state table");
+		table->freq_idx[core][i] = idx;
+	}
+	table->count++;
+	return 0;
+fail:
+	return -1;
+}
+
+/* unpacks state i into the row format */
+void state_table_get(state_table_t *table, int i, unsigned long *state)
+{
+	int core;
+	
+	state[SPEED_IDX] = table->speed[i];
+	state[POWER_IDX] = table->power[i];
+	for (core = 0; core < table->core_count; core++)
+		state[CORE_IDX(core)] = table->freqs[table->freq_idx[core][i]];
+}
+
+unsigned long state_table_freq(state_table_t *table, int i, int core)
+{
+	return table->freqs[table->freq_idx[core][i]];
+}
+
+/* the state whose core frequencies are closest to those of state (in row format), summing the
+ differences over the cores; an exact match if there is one. -1 if the table is empty */
+int state_table_nearest(state_table_t *table, unsigned long *state)
+{
+	unsigned long distance, best_distance = ULONG_MAX, freq;
+	int i, core, best = -1;
+	
+	for (i = 0; i < table->count && best_distance > 0; i++) {
+		for (core = 0, distance = 0; core < table->core_count; core++) {
+			freq = state_table_freq(table, i, core);
+			distance += freq > state[CORE_IDX(core)] ? freq - state[CORE_IDX(core)] : state[CORE_IDX(core)] - freq;
+		}
+		if (distance < best_distance) {
+			best_distance = distance;
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* consumer that appends every state it is given to the state_table_t in ctx */
+int collect_all_states(unsigned long *state, int core_count, void *ctx)
+{
+	return state_table_append(ctx, state);
+}
+
+typedef struct sort_key {
+	unsigned long speed;
+	unsigned long power;
+	int index;
+} sort_key_t;
+
+/* sort by speed, and if the speed is the same, by decreasing power */
+static int key_before(const sort_key_t *a, const sort_key_t *b)
+{
+	if (a->speed != b->speed) return a->speed < b->speed;
+	return a->power > b->power;
+}
+
+/* merges the sorted runs [0, mid) and [mid, n); ties go to the first run */
+static void merge_keys(sort_key_t *keys, sort_key_t *tmp, int mid, int n)
+{
+	int i, j, k;
+	
+	for (i = 0, j = mid, k = 0; i < mid && j < n; )
+		tmp[k++] = key_before(&keys[j], &keys[i]) ? keys[j++] : keys[i++];
+	while (i < mid) tmp[k++] = keys[i++];
+	while (j < n) tmp[k++] = keys[j++];
+	memcpy(keys, tmp, sizeof(sort_key_t) * n);
+}
+
+/* a stable merge sort, so equivalent states stay in generation order */
+static void merge_sort_keys(sort_key_t *keys, sort_key_t *tmp, int n)
+{
+	int mid = n / 2, i, j;
+	sort_key_t key;
+	
+	if (n <= 16) {
+		/* insertion sort for the small runs, also stable */
+		for (i = 1; i < n; i++) {
+			key = keys[i];
+			for (j = i; j > 0 && key_before(&key, &keys[j-1]); j--)
+				keys[j] = keys[j-1];
+			keys[j] = key;
+		}
+		return;
+	}
+	merge_sort_keys(keys, tmp, mid);
+	merge_sort_keys(keys + mid, tmp, n - mid);
+	merge_keys(keys, tmp, mid, n);
+}
+
+/* work on the table's columns is split by core: each job gets a range of freq_idx columns, and the first
+ job also takes speed and power */
+typedef struct column_job {
+	state_table_t *table;
+	int first_core;
+	int last_core;
+	sort_key_t *keys;	/* for permute */
+	uint8_t *keep;		/* for compact */
+	int kept;
+	int err;
+} column_job_t;
+
+static int table_jobs(state_table_t *table)
+{
+	int n = clamp_threads(table->threads);
+	
+	/* not worth a thread below this */
+	if (table->count < 65536) return 1;
+	if (n > table->core_count) n = table->core_count;
+	return n > 1 ? n : 1;
+}
+
+static void prepare_column_jobs(column_job_t *jobs, int job_count, state_table_t *table)
+{
+	int i;
+	
+	for (i = 0; i < job_count; i++)
+		jobs[i] = (column_job_t) { .table = table, .first_core = chunk_start(table->core_count, job_count, i), .last_core = chunk_start(table->core_count, job_count, i + 1) };
+}
+
+/* applies a permutation (new position i takes old state keys[i].index) to the job's columns */
+static void *permute_columns(void *arg)
+{
+	column_job_t *job = arg;
+	state_table_t *table = job->table;
+	uint8_t *column;
+	int i, core;
+	
+	column = malloc(table->count ? table->count : 1);
+	fail_if(!column, "cannot allocate permutation buffer");
+	if (job->first_core == 0) {
+		for (i = 0; i < table->count; i++) {
+			table->speed[i] = job->keys[i].speed;
+			table->power[i] = job->keys[i].power;
+		}
+	}
+	for (core = job->first_core; core < job->last_core; core++) {
+		for (i = 0; i < table->count; i++)
+			column[i] = table->freq_idx[core][job->keys[i].index];
+		memcpy(table->freq_idx[core], column, table->count);
+	}
+	free(column);
+	return NULL;
+fail:
+	job->err = -1;
+	return NULL;
+}
+
+static int state_table_permute(state_table_t *table, sort_key_t *keys)
+{
+	column_job_t jobs[MAX_TABLE_THREADS];
+	int i, job_count = table_jobs(table), err = 0;
+	
+	prepare_column_jobs(jobs, job_count, table);
+	for (i = 0; i < job_count; i++)
+		jobs[i].keys = keys;
+	run_jobs(permute_columns, jobs, sizeof(column_job_t), job_count);
+	for (i = 0; i < job_count; i++)
+		err = err || jobs[i].err;
+	return err ? -1 : 0;
+}
+
+typedef struct sort_job {
+	sort_key_t *keys;
+	sort_key_t *tmp;
+	int lo, mid, hi;
+} sort_job_t;
+
+static void *sort_chunk(void *arg)
+{
+	sort_job_t *job = arg;
+	
+	merge_sort_keys(job->keys + job->lo, job->tmp + job->lo, job->hi - job->lo);
+	return NULL;
+}
+
+static void *merge_chunks(void *arg)
+{
+	sort_job_t *job = arg;
+	
+	merge_keys(job->keys + job->lo, job->tmp + job->lo, job->mid - job->lo, job->hi - job->lo);
+	return NULL;
+}
+
+/* parallel merge sort of keys[0, n): sort job_count chunks side by side, then merge them pairwise,
+ one level at a time; every merge keeps ties in chunk order, so the result is still stable */
+static void parallel_sort_keys(sort_key_t *keys, sort_key_t *tmp, int n, int job_count)
+{
+	sort_job_t jobs[MAX_TABLE_THREADS];
+	int i, width, merges;
+	
+	if (job_count <= 1) {
+		merge_sort_keys(keys, tmp, n);
+		return;
+	}
+	for (i = 0; i < job_count; i++)
+		jobs[i] = (sort_job_t) { .keys = keys, .tmp = tmp, .lo = chunk_start(n, job_count, i), .hi = chunk_start(n, job_count, i + 1) };
+	run_jobs(sort_chunk, jobs, sizeof(sort_job_t), job_count);
+	for (width = 1; width < job_count; width *= 2) {
+		for (i = 0, merges = 0; i + width < job_count; i += 2 * width, merges++) {
+			int last = i + 2 * width < job_count ? i + 2 * width : job_count;
+			jobs[merges] = (sort_job_t) { .keys = keys, .tmp = tmp, .lo = chunk_start(n, job_count, i), .mid = chunk_start(n, job_count, i + width), .hi = chunk_start(n, job_count, last) };
+		}
+		run_jobs(merge_chunks, jobs, sizeof(sort_job_t), merges);
+	}
+}
+
+int state_table_sort(state_table_t *table)
+{
+	sort_key_t *keys = NULL, *tmp = NULL;
+	int i, err = -1;
+	
+	keys = malloc(sizeof(sort_key_t) * table->count);
+	tmp = malloc(sizeof(sort_key_t) * table->count);
+	fail_if(table->count && (!keys || !tmp), "cannot allocate sort buffers");
+	for (i = 0; i < table->count; i++)
+		keys[i] = (sort_key_t) { .speed = table->speed[i], .power = table->power[i], .index = i };
+	/* the collector re-sorts after every batch of appends; only the new tail needs sorting */
+	parallel_sort_keys(keys + table->sorted, tmp, table->count - table->sorted, table->count - table->sorted < 65536 ? 1 : clamp_threads(table->threads));
+	merge_keys(keys, tmp, table->sorted, table->count);
+	err = state_table_permute(table, keys);
+	if (!err) table->sorted = table->count;
+fail:
+	free(keys);
+	free(tmp);
+	return err;
+}
+
+/* keeps the states whose keep flag is set, in order */
+static void *compact_columns(void *arg)
+{
+	column_job_t *job = arg;
+	state_table_t *table = job->table;
+	int i, kept, core;
+	
+	if (job->first_core == 0) {
+		for (i = 0, kept = 0; i < table->count; i++) {
+			if (!job->keep[i]) continue;
+			table->speed[kept] = table->speed[i];
+			table->power[kept] = table->power[i];
+			kept++;
+		}
+		job->kept = kept;
+	}
+	for (core = job->first_core; core < job->last_core; core++) {
+		uint8_t *column = table->freq_idx[core];
+		for (i = 0, kept = 0; i < table->count; i++)
+			if (job->keep[i]) column[kept++] = column[i];
+	}
+	return NULL;
+}
+
+static void state_table_compact(state_table_t *table, uint8_t *keep)
+{
+	column_job_t jobs[MAX_TABLE_THREADS];
+	int i, job_count = table_jobs(table), kept;
+	
+	prepare_column_jobs(jobs, job_count, table);
+	for (i = 0; i < job_count; i++)
+		jobs[i].keep = keep;
+	run_jobs(compact_columns, jobs, sizeof(column_job_t), job_count);
+	kept = jobs[0].kept;
+	if (table->sorted == table->count) table->sorted = kept;
+	else table->sorted = 0;
+	table->count = kept;
+}
+
+/* eliminate permutations by requiring that frequencies be monotonically decreasing; only cores of the same class can be swapped */
+static int redundant_state(state_table_t *table, int i)
+{
+	int core, prev;
+	unsigned long last = ULONG_MAX, freq;
+	
+	for (core = 0; core < table->core_count; core++) {
+		freq = state_table_freq(table, i, core);
+		if (table->core_class) {
+			for (prev = core - 1; prev >= 0 && table->core_class[prev] != table->core_class[core]; prev--)
+				;
+			last = prev >= 0 ? state_table_freq(table, i, prev) : ULONG_MAX;
+		}
+		if (freq > last) return 1;
+		last = freq;
 	}
 	return 0;
 }
@@ -99,34 +700,631 @@ int redundant_state(unsigned long *state, int core_count)
 /*	a point is a Pareto improvement over another if it is better for at least one objective and not worse for any others
  a point is Pareto-optimal if there are no points within the region described by equations x >= x0, y >= y0, z >= z0...
  except for the point (x0,y0,z0...) itself. */
-/* we assume that the list is sorted by speed */
+/* we assume that the table is sorted with state_table_sort. going backwards, a state is dominated iff some
+ state after it uses less power: equal-speed states before it are sorted by decreasing power, so they never do.
+ equivalent states (same speed and power) are adjacent, and we keep the first one, which is also the most
+ unbalanced - good for program with poor parallelism. one pass, O(n). */
+typedef struct filter_job {
+	state_table_t *table;
+	uint8_t *keep;
+	int filters;
+	int lo, hi;
+	unsigned long min_power;	/* of the chunk itself, after the first pass */
+	unsigned long min_power_after;	/* of every chunk after this one */
+} filter_job_t;
 
-int pareto_optimal(unsigned long *state, int state_index, unsigned long *states, int state_count, int core_count)
+static void *chunk_min_power(void *arg)
 {
+	filter_job_t *job = arg;
 	int i;
-	unsigned long *other;
 	
-	/* the immediately preceding states may have equal speed but lower power */
-	for (i = state_index - 1, other = state - STATE_LEN(core_count); i > 0 && other[SPEED_IDX] >= state[SPEED_IDX]; i--, other -= STATE_LEN(core_count)) {
-		if (other[POWER_IDX] < state[POWER_IDX]) return 0;
+	job->min_power = ULONG_MAX;
+	for (i = job->lo; i < job->hi; i++)
+		if (job->table->power[i] < job->min_power) job->min_power = job->table->power[i];
+	return NULL;
+}
+
+static void *filter_chunk(void *arg)
+{
+	filter_job_t *job = arg;
+	state_table_t *table = job->table;
+	unsigned long min_power_after = job->min_power_after;
+	int i, filters = job->filters;
+	uint8_t *keep = job->keep;
+	
+	for (i = job->hi - 1; i >= job->lo; i--) {
+		keep[i] = 1;
+		if ((filters & FILTER_REDUNDANT) && redundant_state(table, i))
+			keep[i] = 0;
+		else if ((filters & FILTER_EQUIVALENT) && i > 0 && table->speed[i-1] == table->speed[i] && table->power[i-1] == table->power[i])
+			keep[i] = 0;
+		else if ((filters & FILTER_UNOPTIMAL) && table->power[i] > min_power_after)
+			keep[i] = 0;
+		else if ((filters & FILTER_IDLE) && table->speed[i] == 0)
+			keep[i] = 0;
+		if (table->power[i] < min_power_after) min_power_after = table->power[i];
+	}
+	return NULL;
+}
+
+/* with several threads, each chunk first finds its own minimum power, which gives every chunk the minimum
+ over all the chunks after it; then the chunks sweep side by side */
+int state_table_filter(state_table_t *table, int filters)
+{
+	filter_job_t jobs[MAX_TABLE_THREADS];
+	uint8_t *keep;
+	int i, job_count = table->count < 65536 ? 1 : clamp_threads(table->threads);
+	unsigned long min_power_after = ULONG_MAX;
+	
+	keep = malloc(table->count);
+	fail_if(table->count && !keep, "cannot allocate filter flags");
+	for (i = 0; i < job_count; i++)
+		jobs[i] = (filter_job_t) { .table = table, .keep = keep, .filters = filters, .lo = chunk_start(table->count, job_count, i), .hi = chunk_start(table->count, job_count, i + 1) };
+	if (job_count > 1) {
+		run_jobs(chunk_min_power, jobs, sizeof(filter_job_t), job_count);
+		for (i = job_count - 1; i >= 0; i--) {
+			jobs[i].min_power_after = min_power_after;
+			if (jobs[i].min_power < min_power_after) min_power_after = jobs[i].min_power;
+		}
+	} else jobs[0].min_power_after = min_power_after;
+	run_jobs(filter_chunk, jobs, sizeof(filter_job_t), job_count);
+	state_table_compact(table, keep);
+	free(keep);
+	return table->count;
+fail:
+	return -1;
+}
+
+/* streaming reduction: a state can only be Pareto optimal if no state of the same speed uses less power,
+ so we keep at most one state per speed and the table stays bounded by the number of distinct speeds */
+
+/* leaves the table sorted by speed, one state per speed: the cheapest, and among equally cheap ones
+ the first generated, which is what FILTER_EQUIVALENT would keep */
+int state_table_keep_cheapest_per_speed(state_table_t *table)
+{
+	uint8_t *keep = NULL;
+	int i, best = -1;
+	
+	fail_if(state_table_sort(table), "cannot sort state table");
+	keep = calloc(table->count ? table->count : 1, 1);
+	fail_if(!keep, "cannot allocate filter flags");
+	for (i = 0; i < table->count; i++) {
+		if (best >= 0 && table->speed[i] == table->speed[best]) {
+			if (table->power[i] < table->power[best]) {
+				keep[best] = 0;
+				keep[best = i] = 1;
+			}
+			continue;
+		}
+		keep[best = i] = 1;
 	}
-	/* the following states have equal or higher speed */
-	for (i = state_index + 1, other = state + STATE_LEN(core_count); i < state_count; i++, other += STATE_LEN(core_count)) {
-		if (other[POWER_IDX] < state[POWER_IDX]) return 0;
+	state_table_compact(table, keep);
+	free(keep);
+	return 0;
+fail:
+	return -1;
+}
+
+int collect_cheapest_per_speed(unsigned long *state, int core_count, void *ctx)
+{
+	state_table_t *table = ctx;
+	
+	if (table->count >= table->size) {
+		fail_if(state_table_keep_cheapest_per_speed(table), "cannot compact state table");
+		/* still more than a quarter full after compaction: there are just that many distinct speeds,
+		 and we want each compaction to pay for itself over a big batch of new states */
+		if (table->count * 4 > table->size)
+			fail_if(state_table_resize(table, table->size * 2), "cannot grow state table");
 	}
-	return 1;
+	return state_table_append(table, state);
+fail:
+	return -1;
 }
 
-/* breaks ties between equivalent states by picking the first state (which is also the most unbalanced - good for program with poor parallelism) */
-int drop_equivalent(unsigned long *state, int state_index, unsigned long *states, int state_count, int core_count)
+/* appends every state of src to dst, translating frequency indices between the two tables */
+int state_table_append_table(state_table_t *dst, state_table_t *src)
 {
-	int i;
-	unsigned long *other;
+	uint8_t map[MAX_TABLE_FREQS];
+	int i, core, idx, size = dst->size;
+	
+	for (i = 0; i < src->freq_count; i++) {
+		idx = state_table_freq_index(dst, src->freqs[i]);
+		fail_if(idx < 0, "too many distinct frequencies for a packed state table");
+		map[i] = idx;
+	}
+	while (size < dst->count + src->count) size *= 2;
+	if (size != dst->size)
+		fail_if(state_table_resize(dst, size), "cannot grow state table");
+	memcpy(dst->speed + dst->count, src->speed, sizeof(unsigned long) * src->count);
+	memcpy(dst->power + dst->count, src->power, sizeof(unsigned long) * src->count);
+	for (core = 0; core < dst->core_count; core++)
+		for (i = 0; i < src->count; i++)
+			dst->freq_idx[core][dst->count + i] = map[src->freq_idx[core][i]];
+	dst->count += src->count;
+	return 0;
+fail:
+	return -1;
+}
+
+/* parallel generation: the states are partitioned by the frequency of the first core, each partition is
+ generated into its own table by whichever thread picks it up, and the partitions are appended in order,
+ so the result is the same as generating everything on one thread */
+
+typedef struct enumerate_shared {
+	pthread_mutex_t lock;
+	int next_partition;
+	int partition_count;
+	state_table_t *partitions;
+	machine_model_t *model;
+	int monotone;
+	state_consumer_t consumer;
+} enumerate_shared_t;
+
+typedef struct enumerate_job {
+	enumerate_shared_t *shared;
+	int err;
+} enumerate_job_t;
+
+static void *enumerate_partitions(void *arg)
+{
+	enumerate_job_t *job = arg;
+	enumerate_shared_t *shared = job->shared;
+	machine_model_t *model = shared->model;
+	int core_count = model->core_count, first_class = model->core_class[0];
+	int freq_count = model->classes[first_class].freq_count;
+	unsigned long *state;
+	state_table_t *partition;
+	enumeration_t e;
+	int k, err = 0;
+	
+	state = malloc(STATE_SIZE(core_count));
+	fail_if(!state, "cannot allocate state enumeration buffer");
+	if (enumeration_init(&e, model, shared->monotone, shared->consumer, NULL)) {
+		free(state);
+		goto fail;
+	}
+	while (!err) {
+		pthread_mutex_lock(&shared->lock);
+		k = shared->next_partition++;
+		pthread_mutex_unlock(&shared->lock);
+		if (k >= shared->partition_count) break;
+		
+		partition = &shared->partitions[k];
+		e.ctx = partition;
+		e.first[first_class] = k;
+		state[CORE_IDX(0)] = (k == freq_count ? 0 : e.freqs[first_class][k]);
+		if (core_count == 1) {
+			machine_model_state_properties(model, state);
+			err = shared->consumer(state, core_count, partition);
+		} else
+			err = enumerate_internal(&e, state, 1);
+		/* shrink the partition before it waits to be appended */
+		if (!err && shared->consumer == collect_cheapest_per_speed)
+			err = state_table_keep_cheapest_per_speed(partition);
+	}
+	enumeration_free(&e);
+	free(state);
+	job->err = err;
+	return NULL;
+fail:
+	job->err = -1;
+	return NULL;
+}
+
+/* enumerate_states on table->threads threads, also telling the table about the model's core classes; the consumer
+ must be one of the collect_* functions, since each partition gets its own table as ctx */
+int enumerate_states_parallel(state_table_t *table, machine_model_t *model, int monotone, state_consumer_t consumer)
+{
+	enumerate_shared_t shared;
+	enumerate_job_t jobs[MAX_TABLE_THREADS];
+	int i, job_count = clamp_threads(table->threads), err = -1;
+	
+	if (state_table_set_classes(table, model)) return -1;
+	if (job_count <= 1)
+		return enumerate_states(model, monotone, consumer, table);
+	
+	shared = (enumerate_shared_t) { .next_partition = 0, .partition_count = model->classes[model->core_class[0]].freq_count + 1,
+		.model = model, .monotone = monotone, .consumer = consumer };
+	pthread_mutex_init(&shared.lock, NULL);
+	shared.partitions = calloc(shared.partition_count, sizeof(state_table_t));
+	fail_if(!shared.partitions, "cannot allocate partitions");
+	for (i = 0; i < shared.partition_count; i++)
+		fail_if(state_table_init(&shared.partitions[i], table->core_count, 4096), "cannot allocate partition");
+	
+	for (i = 0; i < job_count; i++)
+		jobs[i] = (enumerate_job_t) { .shared = &shared, .err = 0 };
+	run_jobs(enumerate_partitions, jobs, sizeof(enumerate_job_t), job_count);
+	for (i = 0, err = 0; i < job_count; i++)
+		err = err || jobs[i].err;
+	for (i = 0; i < shared.partition_count && !err; i++)
+		err = state_table_append_table(table, &shared.partitions[i]);
+fail:
+	if (shared.partitions)
+		for (i = 0; i < shared.partition_count; i++)
+			state_table_free(&shared.partitions[i]);
+	free(shared.partitions);
+	pthread_mutex_destroy(&shared.lock);
+	return err;
+}
+
+/* dense speed -> state lookup over a frontier sorted by strictly increasing speed. each bucket remembers the
+ last state at or below its lower edge, so a lookup is a division plus a walk over the states inside one
+ bucket; with quantum 1 (the usual case, speeds are small integers) that walk is at most one step. */
+
+int speed_index_build(speed_index_t *index, unsigned long *speeds, int state_count, int max_buckets)
+{
+	unsigned long min_speed, max_speed, edge;
+	int b, i;
+	
+	fail_if(state_count < 1, "empty state table");
+	min_speed = speeds[0];
+	max_speed = speeds[state_count - 1];
+	index->min_speed = min_speed;
+	index->quantum = (max_speed - min_speed) / max_buckets + 1;
+	index->bucket_count = (max_speed - min_speed) / index->quantum + 1;
+	index->lower = malloc(sizeof(int) * index->bucket_count);
+	fail_if(!index->lower, "cannot allocate speed index");
+	
+	for (b = 0, i = 0; b < index->bucket_count; b++) {
+		edge = min_speed + b * index->quantum;
+		while (i + 1 < state_count && speeds[i + 1] <= edge) i++;
+		index->lower[b] = i;
+	}
+	return 0;
+fail:
+	return -1;
+}
+
+void speed_index_free(speed_index_t *index)
+{
+	free(index->lower);
+	index->lower = NULL;
+}
+
+/* returns the state closest to speed; below and above (either may be NULL) get the states bracketing it,
+ which are the same state on an exact match or past either end of the table */
+int speed_index_lookup(speed_index_t *index, unsigned long *speeds, int state_count, long speed, int *below, int *above)
+{
+	int i, j;
+	long d_below, d_above;
+	
+	if (speed <= (long)index->min_speed) {
+		i = j = 0;
+	} else {
+		unsigned long b = (speed - index->min_speed) / index->quantum;
+	
+		if (b >= index->bucket_count) b = index->bucket_count - 1;
+		i = index->lower[b];
+		while (i + 1 < state_count && speeds[i + 1] <= speed) i++;
+		j = (speeds[i] == speed || i + 1 >= state_count) ? i : i + 1;
+	}
+	if (below) *below = i;
+	if (above) *above = j;
+	
+	d_below = speed - (long)speeds[i];
+	d_above = (long)speeds[j] - speed;
+	if (d_below < 0) d_below = -d_below;
+	if (d_above < 0) d_above = -d_above;
+	return d_above < d_below ? j : i;
+}
+
+/* on-disk state tables */
+/* a versioned header, then the frequency list, the speed and power columns as 64-bit values and the
+ frequency index columns as bytes. the key in the header says what the table was built from, so a
+ stale cache is simply rebuilt. */
+
+#define STATE_CACHE_MAGIC "HBSTATES"
+#define STATE_CACHE_VERSION 1
+
+typedef struct state_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t core_count;
+	uint32_t freq_count;
+	uint32_t state_count;
+	uint64_t key;
+} state_cache_header_t;
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* identifies a frontier by everything it depends on: each core's frequency list (in any order) and coefficients,
+ filters and power model. the key is never 0, which means "any key" to state_table_load */
+int state_table_key(machine_model_t *model, int filters, uint64_t *key)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL, value;
+	unsigned long *freqs;
+	core_class_t *class;
+	int i, core;
+	
+	value = POWER_MODEL_VERSION;
+	hash = fnv1a(hash, &value, sizeof(value));
+	value = model->core_count;
+	hash = fnv1a(hash, &value, sizeof(value));
+	value = filters;
+	hash = fnv1a(hash, &value, sizeof(value));
+	/* per core rather than per class, so the same machine hashes the same however its classes are numbered */
+	for (core = 0; core < model->core_count; core++) {
+		class = &model->classes[model->core_class[core]];
+		freqs = malloc(sizeof(unsigned long) * (class->freq_count > 0 ? class->freq_count : 1));
+		fail_if(!freqs, "cannot allocate state table key");
+		memcpy(freqs, class->freqs, sizeof(unsigned long) * class->freq_count);
+		qsort(freqs, class->freq_count, sizeof(unsigned long), compare_freqs_descending);
+		value = class->freq_count;
+		hash = fnv1a(hash, &value, sizeof(value));
+		for (i = 0; i < class->freq_count; i++) {
+			value = freqs[i];
+			hash = fnv1a(hash, &value, sizeof(value));
+		}
+		free(freqs);
+		value = class->speed_scale;
+		hash = fnv1a(hash, &value, sizeof(value));
+		value = class->power_scale;
+		hash = fnv1a(hash, &value, sizeof(value));
+		value = class->static_power;
+		hash = fnv1a(hash, &value, sizeof(value));
+	}
+	*key = hash ? hash : 1;
+	return 0;
+fail:
+	return -1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
 	
-	for (i = state_index - 1, other = state - STATE_LEN(core_count); i > 0 && other[SPEED_IDX] >= state[SPEED_IDX]; i--, other -= STATE_LEN(core_count)) {
-		if (other[POWER_IDX] == state[POWER_IDX]) return 1;
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
 	}
 	return 0;
 }
 
+static int write_u64_column(int fd, unsigned long *values, int count)
+{
+	uint64_t buf[512];
+	int i, n;
+	
+	for (i = 0; i < count; i += n) {
+		for (n = 0; n < 512 && i + n < count; n++)
+			buf[n] = values[i + n];
+		if (write_all(fd, buf, sizeof(uint64_t) * n)) return -1;
+	}
+	return 0;
+}
+
+/* written to a temporary file and renamed into place, so readers never see half a table */
+int state_table_save(state_table_t *table, const char *path, uint64_t key)
+{
+	char tmp_path[PATH_MAX];
+	state_cache_header_t header;
+	int fd = -1, core, err;
+	
+	/* mkstemp creates the file exclusively, so nobody can plant a link where we write; rename then
+	 replaces whatever is at path without following it */
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= (int)sizeof(tmp_path)) errno = ENAMETOOLONG;
+	else fd = mkstemp(tmp_path);
+	if (fd < 0) tmp_path[0] = '\0';
+	fail_if(fd < 0, "cannot create state cache");
+	fail_if(fchmod(fd, 0644), "cannot create state cache");
+	
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, STATE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = STATE_CACHE_VERSION;
+	header.core_count = table->core_count;
+	header.freq_count = table->freq_count;
+	header.state_count = table->count;
+	header.key = key;
+	err = write_all(fd, &header, sizeof(header)) ||
+		write_u64_column(fd, table->freqs, table->freq_count) ||
+		write_u64_column(fd, table->speed, table->count) ||
+		write_u64_column(fd, table->power, table->count);
+	for (core = 0; core < table->core_count && !err; core++)
+		err = write_all(fd, table->freq_idx[core], table->count);
+	fail_if(err, "cannot write state cache");
+	fail_if(close(fd), "cannot write state cache");
+	fd = -1;
+	fail_if(rename(tmp_path, path), "cannot move state cache into place");
+	return 0;
+fail:
+	if (fd >= 0) close(fd);
+	if (tmp_path[0]) unlink(tmp_path);
+	return -1;
+}
+
+/* returns 0 if the table was loaded, 1 if there is no usable table at path (missing, not a state cache,
+ another version or, unless key is 0, another key), -1 on errors. the table decides which states the
+ controller may pick, so we don't follow links, and only trust a regular file that we or root own and
+ nobody else can write */
+int state_table_load(state_table_t *table, const char *path, uint64_t key)
+{
+	state_cache_header_t header;
+	struct stat st;
+	unsigned char *map = MAP_FAILED;
+	const unsigned char *p;
+	uint64_t value;
+	size_t expected;
+	int fd, i, core, result = 1;
+	
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0 && errno == ENOENT) return 1;
+	fail_if(fd < 0, "cannot open state cache");
+	fail_if(fstat(fd, &st), "cannot stat state cache");
+	if (!S_ISREG(st.st_mode) || (st.st_uid != geteuid() && st.st_uid != 0) || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		fprintf(stderr, "%s: not trusting a state cache that isn't a regular file of ours\n", path);
+		goto end;
+	}
+	if ((size_t)st.st_size < sizeof(header)) goto end;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	fail_if(map == MAP_FAILED, "cannot map state cache");
+	
+	memcpy(&header, map, sizeof(header));
+	if (memcmp(header.magic, STATE_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != STATE_CACHE_VERSION) goto end;
+	if (key && header.key != key) goto end;
+	if (header.core_count < 1 || header.freq_count > MAX_TABLE_FREQS) goto end;
+	expected = sizeof(header) + sizeof(uint64_t) * (header.freq_count + 2 * (size_t)header.state_count) + (size_t)header.core_count * header.state_count;
+	if ((size_t)st.st_size != expected) goto end;
+	
+	fail_if(state_table_init(table, header.core_count, header.state_count), "cannot allocate state table");
+	p = map + sizeof(header);
+	table->freq_count = header.freq_count;
+	for (i = 0; i < table->freq_count; i++, p += sizeof(uint64_t)) {
+		memcpy(&value, p, sizeof(value));
+		table->freqs[i] = value;
+	}
+	for (i = 0; i < (int)header.state_count; i++, p += sizeof(uint64_t)) {
+		memcpy(&value, p, sizeof(value));
+		table->speed[i] = value;
+	}
+	for (i = 0; i < (int)header.state_count; i++, p += sizeof(uint64_t)) {
+		memcpy(&value, p, sizeof(value));
+		table->power[i] = value;
+	}
+	for (core = 0; core < table->core_count; core++, p += header.state_count)
+		memcpy(table->freq_idx[core], p, header.state_count);
+	for (core = 0; core < table->core_count; core++)
+		for (i = 0; i < (int)header.state_count; i++)
+			if (table->freq_idx[core][i] >= table->freq_count) {
+				state_table_free(table);
+				goto end;
+			}
+	table->count = header.state_count;
+	/* a cache was saved sorted, but a -f table may have been edited since: only trust the prefix that is */
+	for (i = 1; i < table->count; i++)
+		if (table->speed[i] < table->speed[i - 1] || (table->speed[i] == table->speed[i - 1] && table->power[i] > table->power[i - 1])) break;
+	table->sorted = table->count ? i : 0;
+	result = 0;
+end:
+	if (map != MAP_FAILED) munmap(map, st.st_size);
+	close(fd);
+	return result;
+fail:
+	result = -1;
+	if (fd >= 0) goto end;
+	return result;
+}
+
+/* text state tables */
+
+/* reports a problem in a state file the way compilers do, so editors can jump to it. the errno is for
+ callers that report the failure again */
+#define parse_fail_if(exp, msg) do { if ((exp)) { fprintf(stderr, "%s:%d: %s\n", name, line_no, (msg)); errno = EINVAL; goto fail; } } while (0)
+
+static const char *skip_blanks(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+	return p;
+}
+
+/* plain digit loop: no locale, no errno, no stdio; returns NULL if there is no number or it overflows */
+static const char *parse_ulong(const char *p, const char *end, unsigned long *value)
+{
+	const char *start = p;
+	unsigned long v = 0, digit;
+	
+	while (p < end && (digit = (unsigned char)*p - '0') < 10) {
+		if (v > (ULONG_MAX - digit) / 10) return NULL;
+		v = v * 10 + digit;
+		p++;
+	}
+	if (p == start) return NULL;
+	*value = v;
+	return p;
+}
+
+/* reads the tab-separated text format that powerstates prints: a header naming the cores, then one state
+ per line. the whole file is mapped and parsed in place; lines are counted first so the table is allocated once */
+int state_table_read_text(state_table_t *states, const char *name)
+{
+	int fd = -1;
+	struct stat st;
+	const char *map = MAP_FAILED, *p, *end, *eol;
+	int j, core_count = 0, line_no = 1, line_count;
+	unsigned long *state = NULL, n;
+	int allocated = 0, err = -1;
+	
+	fd = open(name, O_RDONLY);
+	fail_if(fd < 0, "could not open file");
+	fail_if(fstat(fd, &st), "could not stat file");
+	parse_fail_if(st.st_size == 0, "empty state file");
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	fail_if(map == MAP_FAILED, "could not map file");
+	end = map + st.st_size;
+	
+	/* header: speed, power, then core0, core1... */
+	eol = memchr(map, '\n', end - map);
+	if (!eol) eol = end;
+	for (p = map; p < eol; ) {
+		const char *token;
+		p = skip_blanks(p, eol);
+		token = p;
+		while (p < eol && *p != ' ' && *p != '\t' && *p != '\r') p++;
+		/* the map isn't NUL-terminated, so no sscanf here */
+		if (p - token > 4 && memcmp(token, "core", 4) == 0 && parse_ulong(token + 4, p, &n) == p && n < INT_MAX)
+			core_count = n + 1;
+	}
+	parse_fail_if(core_count < 1, "header names no cores");
+	
+	for (line_count = 0, p = eol; p < end && (p = memchr(p, '\n', end - p)) != NULL; p++)
+		line_count++;
+	
+	state = malloc(STATE_SIZE(core_count));
+	fail_if(!state, "cannot allocate state");
+	fail_if(state_table_init(states, core_count, line_count + 1), "cannot allocate state table");
+	allocated = 1;
+	
+	for (p = eol < end ? eol + 1 : end; p < end; p = eol + 1) {
+		line_no++;
+		eol = memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+		p = skip_blanks(p, eol);
+		if (p == eol) continue;
+		for (j = 0; j < STATE_LEN(core_count); j++) {
+			p = skip_blanks(p, eol);
+			parse_fail_if(p == eol, "too few fields");
+			p = parse_ulong(p, eol, &state[j]);
+			parse_fail_if(!p, "not a number");
+		}
+		parse_fail_if(skip_blanks(p, eol) != eol, "too many fields");
+		fail_if(state_table_append(states, state), "cannot store state");
+		if (eol == end) break;
+	}
+	err = 0;
+fail:
+	if (err && allocated) state_table_free(states);
+	if (map != MAP_FAILED) munmap((void *)map, st.st_size);
+	if (fd >= 0) close(fd);
+	if (state) free(state);
+	return err;
+}
 
+int state_table_write_text(state_table_t *table, FILE *f)
+{
+	int i, j;
+	
+	fprintf(f, "speed\tpower");
+	for (j = 0; j < table->core_count; j++)
+		fprintf(f, "\tcore%d", j);
+	fprintf(f, "\n");
+	
+	for (i = 0; i < table->count; i++) {
+		fprintf(f, "%lu\t%lu", table->speed[i], table->power[i]);
+		for (j = 0; j < table->core_count; j++)
+			fprintf(f, "\t%lu", state_table_freq(table, i, j));
+		fprintf(f, "\n");
+	}
+	return ferror(f) ? -1 : 0;
+}
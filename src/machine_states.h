@@ -6,6 +6,10 @@
  *
  */
 
+#include <stdio.h>
+#include <stdint.h>
+
+/* a single state in row format: speed, power, then the frequency of each core (0 is off) */
 #define SPEED_IDX 0
 #define POWER_IDX 1
 #define CORE_IDX(core) ((core) + 2)
@@ -13,9 +17,98 @@
 #define STATE_SIZE(core_count) (sizeof(unsigned long) * STATE_LEN(core_count))
 #define STATE_I(states, core_count, i) ((states) + STATE_LEN(core_count) * (i))
 
+/* flags for state_table_filter */
+#define FILTER_REDUNDANT 0x01
+#define FILTER_EQUIVALENT 0x02
+#define FILTER_UNOPTIMAL 0x04
+#define FILTER_IDLE 0x08	/* zero speed, i.e. every core off */
+
+/* distinct frequencies (off included) a packed table can index */
+#define MAX_TABLE_FREQS 256
+
+/* upper bound for state_table_t.threads */
+#define MAX_TABLE_THREADS 64
+
+/* coefficients of a core with calculate_state_properties' made up model */
+#define CORE_SCALE_UNIT 1000	/* speed_scale and power_scale are in thousandths of this */
+#define DEFAULT_STATIC_POWER 1000000
+
+/* receives each generated state; return non-zero to stop the enumeration */
+typedef int (*state_consumer_t) (unsigned long *state, int core_count, void *ctx);
+
+/* packed state table: speed and power columns plus one column of frequency indices per core */
+typedef struct state_table {
+	int core_count;
+	int count;
+	int size;
+	int sorted;	/* length of the prefix known to be in state_table_sort order */
+	int threads;	/* how many threads sorting, filtering and parallel generation may use */
+	int freq_count;
+	unsigned long freqs[MAX_TABLE_FREQS];	/* index -> frequency */
+	unsigned long *speed;
+	unsigned long *power;
+	uint8_t **freq_idx;	/* freq_idx[core][state] */
+	uint8_t *freq_base;	/* backing store for the freq_idx columns */
+	int *core_class;	/* core -> class, for FILTER_REDUNDANT; NULL if all cores are alike. a copy of the model's */
+} state_table_t;
+
+/* cores that share a frequency list and speed/power coefficients */
+typedef struct core_class {
+	int freq_count;
+	unsigned long *freqs;
+	unsigned long speed_scale;	/* speed at a given frequency, relative to CORE_SCALE_UNIT */
+	unsigned long power_scale;	/* dynamic power at a given frequency, relative to CORE_SCALE_UNIT */
+	unsigned long static_power;	/* paid by every core that is on */
+} core_class_t;
+
+/* what the machine looks like to the state generator: on hybrid or mixed-SKU hosts each kind of core
+ is a class of its own, and only cores of the same class are interchangeable */
+typedef struct machine_model {
+	int core_count;
+	int class_count;
+	core_class_t *classes;
+	int *core_class;	/* core -> index into classes */
+} machine_model_t;
+
+typedef struct speed_index {
+	unsigned long min_speed;
+	unsigned long quantum;	/* speed units per bucket */
+	unsigned long bucket_count;
+	int *lower;	/* per bucket, the last state whose speed is <= the bucket's lower edge */
+} speed_index_t;
+
+int machine_model_init(machine_model_t *model, int core_count);
+int machine_model_init_uniform(machine_model_t *model, int core_count, int freq_count, unsigned long *freq_array);
+void machine_model_free(machine_model_t *model);
+int machine_model_add_class(machine_model_t *model, int freq_count, unsigned long *freq_array, unsigned long speed_scale, unsigned long power_scale, unsigned long static_power);
+void machine_model_set_class(machine_model_t *model, int core, int class_index);
+int machine_model_copy(machine_model_t *dst, machine_model_t *src);
+
 void calculate_state_properties(unsigned long *state, int core_count);
-unsigned long *create_machine_states(int *state_count, int core_count, int freq_count, unsigned long *freq_array);
-int compare_states_on_speed(const void *a, const void *b);
-int redundant_state(unsigned long *state, int core_count);
-int pareto_optimal(unsigned long *state, int state_index, unsigned long *states, int state_count, int core_count);
-int drop_equivalent(unsigned long *state, int state_index, unsigned long *states, int state_count, int core_count);
+void machine_model_state_properties(machine_model_t *model, unsigned long *state);
+unsigned long monotone_state_count(int core_count, int freq_count);
+unsigned long machine_model_state_count(machine_model_t *model, int monotone);
+
+int state_table_init(state_table_t *table, int core_count, int size);
+void state_table_free(state_table_t *table);
+int state_table_set_classes(state_table_t *table, machine_model_t *model);
+int state_table_append(state_table_t *table, unsigned long *state);
+void state_table_get(state_table_t *table, int i, unsigned long *state);
+unsigned long state_table_freq(state_table_t *table, int i, int core);
+int state_table_nearest(state_table_t *table, unsigned long *state);
+int state_table_sort(state_table_t *table);
+int state_table_filter(state_table_t *table, int filters);
+int state_table_keep_cheapest_per_speed(state_table_t *table);
+int collect_all_states(unsigned long *state, int core_count, void *ctx);
+int collect_cheapest_per_speed(unsigned long *state, int core_count, void *ctx);
+int state_table_append_table(state_table_t *dst, state_table_t *src);
+int enumerate_states_parallel(state_table_t *table, machine_model_t *model, int monotone, state_consumer_t consumer);
+int state_table_key(machine_model_t *model, int filters, uint64_t *key);
+int state_table_save(state_table_t *table, const char *path, uint64_t key);
+int state_table_load(state_table_t *table, const char *path, uint64_t key);
+int state_table_read_text(state_table_t *table, const char *path);
+int state_table_write_text(state_table_t *table, FILE *f);
+
+int speed_index_build(speed_index_t *index, unsigned long *speeds, int state_count, int max_buckets);
+void speed_index_free(speed_index_t *index);
+int speed_index_lookup(speed_index_t *index, unsigned long *speeds, int state_count, long speed, int *below, int *above);
@@ -0,0 +1,300 @@
+/*
+ *  power_model.c
+ *  heartbeats
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <math.h>
+
+#include "machine_states.h"
+#include "power_model.h"
+
+#define fail_if(exp, msg) do { if ((exp)) { fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, (msg), strerror(errno)); goto fail; } } while (0)
+
+/* shorter stretches are mostly RAPL update jitter (the counters tick about every millisecond) */
+#define MIN_SAMPLE_NS 10000000LL
+/* longer ones are cut, so a steady state still feeds the fit */
+#define MAX_SAMPLE_NS 200000000LL
+/* how many seconds of samples the previous coefficients are worth */
+#define PRIOR_WEIGHT 1.0
+/* the model works in milliwatts and GHz, which keeps the normal equations well scaled */
+#define KHZ_PER_GHZ 1e6
+
+/* RAPL counters */
+
+static int read_u64(int fd, uint64_t *value)
+{
+	char buf[32];
+	ssize_t n;
+	
+	n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0) return -1;
+	buf[n] = '\0';
+	return sscanf(buf, "%llu", (unsigned long long *)value) == 1 ? 0 : -1;
+}
+
+static int read_u64_file(const char *path, uint64_t *value)
+{
+	int fd, err;
+	
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	err = read_u64(fd, value);
+	close(fd);
+	return err;
+}
+
+/* only the top-level zones (intel-rapl:N): their subzones are already counted in them */
+int rapl_open(rapl_t *rapl, const char *root)
+{
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *entry;
+	int zone, end, z;
+	
+	if (!root) root = POWERCAP_DEFAULT_ROOT;
+	memset(rapl, 0, sizeof(*rapl));
+	dir = opendir(root);
+	fail_if(!dir, "cannot open powercap directory");
+	while ((entry = readdir(dir)) != NULL && rapl->zone_count < RAPL_MAX_ZONES) {
+		end = 0;
+		if (sscanf(entry->d_name, "intel-rapl:%d%n", &zone, &end) < 1 || entry->d_name[end] != '\0') continue;
+		z = rapl->zone_count;
+		snprintf(path, sizeof(path), "%s/%s/max_energy_range_uj", root, entry->d_name);
+		if (read_u64_file(path, &rapl->max_range[z])) rapl->max_range[z] = 0;
+		snprintf(path, sizeof(path), "%s/%s/energy_uj", root, entry->d_name);
+		rapl->fds[z] = open(path, O_RDONLY);
+		if (rapl->fds[z] < 0) continue;
+		if (read_u64(rapl->fds[z], &rapl->last[z])) {
+			close(rapl->fds[z]);
+			continue;
+		}
+		rapl->zone_count++;
+	}
+	closedir(dir);
+	if (rapl->zone_count == 0) errno = ENOENT;
+	fail_if(rapl->zone_count == 0, "no readable RAPL zones");
+	return 0;
+fail:
+	return -1;
+}
+
+void rapl_close(rapl_t *rapl)
+{
+	int z;
+	
+	for (z = 0; z < rapl->zone_count; z++)
+		close(rapl->fds[z]);
+	rapl->zone_count = 0;
+}
+
+/* total energy since rapl_open; must be called more often than the counters wrap (minutes, at worst) */
+int rapl_energy(rapl_t *rapl, uint64_t *energy)
+{
+	uint64_t value;
+	int z;
+	
+	for (z = 0; z < rapl->zone_count; z++) {
+		if (read_u64(rapl->fds[z], &value)) return -1;
+		if (value >= rapl->last[z]) rapl->total += value - rapl->last[z];
+		else if (rapl->max_range[z]) rapl->total += rapl->max_range[z] - rapl->last[z] + value;
+		rapl->last[z] = value;
+	}
+	*energy = rapl->total;
+	return 0;
+}
+
+/* the model */
+
+static void state_features(power_model_t *pm, unsigned long *state, double *x)
+{
+	machine_model_t *machine = pm->machine;
+	int core, k;
+	
+	memset(x, 0, sizeof(double) * pm->param_count);
+	x[0] = 1.0;
+	for (core = 0; core < machine->core_count; core++) {
+		if (state[CORE_IDX(core)] == 0) continue;
+		k = machine->core_class[core];
+		x[1 + 2 * k] += 1.0;
+		x[2 + 2 * k] += state[CORE_IDX(core)] / KHZ_PER_GHZ;
+	}
+}
+
+/* calculate_state_properties divides its sums by 10000, so this is what its coefficients mean in mW */
+static void coefficients_from_class(core_class_t *class, double *static_mw, double *dynamic_mw_per_ghz)
+{
+	*static_mw = class->static_power / 10000.0;
+	*dynamic_mw_per_ghz = class->power_scale * KHZ_PER_GHZ / (10000.0 * CORE_SCALE_UNIT);
+}
+
+static void class_from_coefficients(core_class_t *class, double static_mw, double dynamic_mw_per_ghz)
+{
+	/* negative power only ever comes from noise */
+	if (static_mw < 0) static_mw = 0;
+	if (dynamic_mw_per_ghz < 0) dynamic_mw_per_ghz = 0;
+	class->static_power = (unsigned long)(static_mw * 10000.0 + 0.5);
+	class->power_scale = (unsigned long)(dynamic_mw_per_ghz * 10000.0 * CORE_SCALE_UNIT / KHZ_PER_GHZ + 0.5);
+}
+
+int power_model_init(power_model_t *pm, machine_model_t *machine, const char *root)
+{
+	int k, n;
+	
+	memset(pm, 0, sizeof(*pm));
+	pm->machine = machine;
+	pm->param_count = n = 1 + 2 * machine->class_count;
+	pm->xtx = calloc(n * n, sizeof(double));
+	pm->xty = calloc(n, sizeof(double));
+	pm->prior = calloc(n, sizeof(double));
+	pm->state = malloc(STATE_SIZE(machine->core_count));
+	fail_if(!pm->xtx || !pm->xty || !pm->prior || !pm->state, "cannot allocate power model");
+	for (k = 0; k < machine->class_count; k++)
+		coefficients_from_class(&machine->classes[k], &pm->prior[1 + 2 * k], &pm->prior[2 + 2 * k]);
+	fail_if(rapl_open(&pm->rapl, root), "cannot open RAPL counters");
+	return 0;
+fail:
+	power_model_free(pm);
+	return -1;
+}
+
+void power_model_free(power_model_t *pm)
+{
+	rapl_close(&pm->rapl);
+	free(pm->xtx);
+	free(pm->xty);
+	free(pm->prior);
+	free(pm->state);
+	pm->xtx = pm->xty = pm->prior = NULL;
+	pm->state = NULL;
+}
+
+static void add_sample(power_model_t *pm, double power_mw, double seconds)
+{
+	double x[pm->param_count];
+	int i, j, n = pm->param_count;
+	
+	state_features(pm, pm->state, x);
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++)
+			pm->xtx[i * n + j] += seconds * x[i] * x[j];
+		pm->xty[i] += seconds * x[i] * power_mw;
+	}
+	pm->weight += seconds;
+}
+
+/* what the current coefficients say the machine draws in a state, idle included, in mW */
+double power_model_predict(power_model_t *pm, unsigned long *state)
+{
+	double x[pm->param_count], power = pm->idle_power;
+	int k;
+	
+	state_features(pm, state, x);
+	for (k = 0; k < pm->machine->class_count; k++) {
+		double static_mw, dynamic_mw_per_ghz;
+		
+		coefficients_from_class(&pm->machine->classes[k], &static_mw, &dynamic_mw_per_ghz);
+		power += x[1 + 2 * k] * static_mw + x[2 + 2 * k] * dynamic_mw_per_ghz;
+	}
+	return power;
+}
+
+/* call whenever the machine state may have changed (and now and then when it hasn't), with the state
+ that is in force from now on. returns 1 if a sample was taken, 0 if not, -1 on errors */
+int power_model_observe(power_model_t *pm, unsigned long *state, int64_t now)
+{
+	uint64_t energy;
+	int64_t elapsed = now - pm->start_time;
+	int core, changed = 0, sampled = 0;
+	
+	for (core = 0; core < pm->machine->core_count; core++)
+		changed = changed || state[CORE_IDX(core)] != pm->state[CORE_IDX(core)];
+	if (pm->measuring && !changed && elapsed < MAX_SAMPLE_NS) return 0;
+	
+	fail_if(rapl_energy(&pm->rapl, &energy), "cannot read RAPL counters");
+	if (pm->measuring && elapsed >= MIN_SAMPLE_NS) {
+		/* uJ per ns is kW, so this comes out in mW */
+		pm->last_power = (energy - pm->start_energy) * 1e6 / elapsed;
+		pm->last_predicted = power_model_predict(pm, pm->state);
+		add_sample(pm, pm->last_power, elapsed / 1e9);
+		sampled = 1;
+	}
+	memcpy(pm->state, state, STATE_SIZE(pm->machine->core_count));
+	pm->start_time = now;
+	pm->start_energy = energy;
+	pm->measuring = 1;
+	return sampled;
+fail:
+	pm->measuring = 0;
+	return -1;
+}
+
+/* solves a x = b in place by gaussian elimination with partial pivoting; b ends up holding x */
+static int solve(double *a, double *b, int n)
+{
+	int i, j, k, pivot;
+	double t;
+	
+	for (k = 0; k < n; k++) {
+		for (pivot = k, i = k + 1; i < n; i++)
+			if (fabs(a[i * n + k]) > fabs(a[pivot * n + k])) pivot = i;
+		if (fabs(a[pivot * n + k]) < 1e-12) return -1;
+		if (pivot != k) {
+			for (j = 0; j < n; j++) {
+				t = a[k * n + j]; a[k * n + j] = a[pivot * n + j]; a[pivot * n + j] = t;
+			}
+			t = b[k]; b[k] = b[pivot]; b[pivot] = t;
+		}
+		for (i = k + 1; i < n; i++) {
+			t = a[i * n + k] / a[k * n + k];
+			for (j = k; j < n; j++)
+				a[i * n + j] -= t * a[k * n + j];
+			b[i] -= t * b[k];
+		}
+	}
+	for (k = n - 1; k >= 0; k--) {
+		for (j = k + 1; j < n; j++)
+			b[k] -= a[k * n + j] * b[j];
+		b[k] /= a[k * n + k];
+	}
+	return 0;
+}
+
+/* refits the machine model's power coefficients from every sample so far. idle power is fitted but
+ left out of the model: it is the same in every state, so it doesn't move the frontier. returns 1 if
+ the coefficients changed (and the frontier should be rebuilt), 0 if not, -1 on errors */
+int power_model_fit(power_model_t *pm)
+{
+	int i, k, n = pm->param_count, changed = 0;
+	double a[n * n], b[n];
+	unsigned long old_static, old_scale;
+	core_class_t *class;
+	
+	if (pm->weight <= 0) return 0;
+	memcpy(a, pm->xtx, sizeof(a));
+	memcpy(b, pm->xty, sizeof(b));
+	/* the prior doesn't know the idle power, so it only holds the per-class terms */
+	for (i = 1; i < n; i++) {
+		a[i * n + i] += PRIOR_WEIGHT;
+		b[i] += PRIOR_WEIGHT * pm->prior[i];
+	}
+	if (solve(a, b, n)) return 0;	/* not enough different states yet */
+	pm->idle_power = b[0] > 0 ? b[0] : 0;
+	
+	for (k = 0; k < pm->machine->class_count; k++) {
+		class = &pm->machine->classes[k];
+		old_static = class->static_power;
+		old_scale = class->power_scale;
+		class_from_coefficients(class, b[1 + 2 * k], b[2 + 2 * k]);
+		changed = changed || class->static_power != old_static || class->power_scale != old_scale;
+	}
+	return changed;
+}
@@ -0,0 +1,53 @@
+/*
+ *  power_model.h
+ *  heartbeats
+ *
+ */
+
+#include <stdint.h>
+
+#define POWERCAP_DEFAULT_ROOT "/sys/class/powercap"
+#define RAPL_MAX_ZONES 16
+
+/* package-level RAPL energy counters, read through fds kept open like the cpufreq ones */
+typedef struct rapl {
+	int zone_count;
+	int fds[RAPL_MAX_ZONES];
+	uint64_t max_range[RAPL_MAX_ZONES];	/* energy_uj wraps around here */
+	uint64_t last[RAPL_MAX_ZONES];
+	uint64_t total;	/* microjoules since rapl_open, over all zones */
+} rapl_t;
+
+/* fits the power coefficients of a machine_model_t to measured energy. power is modelled as
+ idle + sum over the cores that are on of (static + dynamic * frequency), with one static and one
+ dynamic coefficient per core class. each sample is the average power over a stretch of time spent in
+ a single machine state, weighted by its length; the fit is least squares, pulled towards the model's
+ previous coefficients so that the states we never visit don't go wild. */
+typedef struct power_model {
+	machine_model_t *machine;
+	rapl_t rapl;
+	int param_count;	/* idle, then static and dynamic for each class */
+	double *xtx;	/* weighted normal equations */
+	double *xty;
+	double *prior;
+	double weight;	/* seconds of samples so far */
+	/* the stretch being measured */
+	unsigned long *state;
+	int64_t start_time;
+	uint64_t start_energy;
+	int measuring;
+	/* the last sample and what the model said it would be, both in mW */
+	double last_power;
+	double last_predicted;
+	double idle_power;	/* fitted, in mW */
+} power_model_t;
+
+int rapl_open(rapl_t *rapl, const char *root);
+void rapl_close(rapl_t *rapl);
+int rapl_energy(rapl_t *rapl, uint64_t *energy);
+
+int power_model_init(power_model_t *pm, machine_model_t *machine, const char *root);
+void power_model_free(power_model_t *pm);
+int power_model_observe(power_model_t *pm, unsigned long *state, int64_t now);
+int power_model_fit(power_model_t *pm);
+double power_model_predict(power_model_t *pm, unsigned long *state);
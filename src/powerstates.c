@@ -60,69 +60,26 @@ fail:
 	return -1;
 }
 
-static unsigned long *read_states_file(char *name, int *state_count, int *core_count)
-{
-	FILE *fp = NULL;
-	char buf[512];
-	char *line, *token;
-	int n, j;
-	unsigned long *states = NULL, *state = NULL, *state_cursor;
-	
-	fp = fopen(name, "r");
-	fail_if(!fp, "could not open file");
-	
-	line = fgets(buf, sizeof(buf), fp);
-	fail_if(!line, "wrong format");
-	while ((token = strsep(&line, " \t")) != NULL)
-		if (sscanf(token, "core%d", &n) >= 1)
-			*core_count = n + 1;
-	fail_if(*core_count < 1, "wrong format");
-	
-	n = 1000;
-	state = malloc(STATE_SIZE(*core_count));
-	state_cursor = states = malloc(STATE_SIZE(*core_count) * n);
-	*state_count = 0;
-	
-	while (1) {
-		if (fscanf(fp, "%lu\t%lu", &state[SPEED_IDX], &state[POWER_IDX]) < 2) goto end;
-		for (j = 0; j < *core_count; j++)
-			if (fscanf(fp, "\t%lu", &state[CORE_IDX(j)]) < 1) goto end;
-		if (getc(fp) != '\n') goto end;
-		
-		if (*state_count >= n) {
-			n *= 2;
-			states = realloc(states, STATE_SIZE(*core_count) * n);
-			state_cursor = states + STATE_LEN(*core_count) * *state_count;
-		}
-		(*state_count)++;
-		memcpy(state_cursor, state, STATE_SIZE(*core_count));
-		state_cursor += STATE_LEN(*core_count);
-	}
-end:
-	if (fp) fclose(fp);
-	if (state) free(state);
-	return states;
-fail:
-	if (states) free(states);
-	states = NULL;
-	goto end;
-}
-
 int main(int argc, char **argv)
 {
 	struct cpufreq_available_frequencies *freq_list;
 	int core_count;
-	int i, j;
-	unsigned long *states, *state;
-	int state_count;
+	int err;
+	state_table_t states;
 
 	int opt;
 	int skip_redundant = 0;
 	int skip_unoptimal = 0;
 	char *state_file_name = NULL;
 	int skip_equivalent = 0;
+	int filters;
+	int threads = 1;
+	char *output_file_name = NULL;
+	int freq_count = 0;
+	unsigned long *freq_array = NULL;
+	machine_model_t model = { 0 };
 	
-	while ((opt = getopt(argc, argv, "rpf:u")) != -1) switch (opt) {
+	while ((opt = getopt(argc, argv, "rpf:uj:o:")) != -1) switch (opt) {
 	case 'r':
 		skip_redundant = 1;
 		break;
@@ -135,43 +92,60 @@ int main(int argc, char **argv)
 	case 'u':
 		skip_equivalent = 1;
 		break;
+	case 'j':
+		if (sscanf(optarg, "%d", &threads) < 1 || threads < 1) {
+			fprintf(stderr, "%s: bad thread count\n", argv[0]);
+			exit(1);
+		}
+		break;
+	case 'o':
+		output_file_name = optarg;
+		break;
 	default:
-		fprintf(stderr, "Usage: %s [-r] [-p] [-f file] [-u]\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-r] [-p] [-f file] [-u] [-j threads] [-o binary_file]\n", argv[0]);
 		exit(1);
 	}
 	
 	if (state_file_name) {
-		states = read_states_file(state_file_name, &state_count, &core_count);
+		/* binary tables (as written by -o or the controller's cache) load as they are; anything else is text */
+		err = state_table_load(&states, state_file_name, 0);
+		fail_if(err < 0, "cannot read state file");
+		if (err)
+			err = state_table_read_text(&states, state_file_name);
+		fail_if(err, "cannot read state file");
+		core_count = states.core_count;
 	} else {
-		int freq_count;
-		unsigned long *freq_array;
-		
 		core_count = get_core_count();
 		freq_list = cpufreq_get_available_frequencies(0);
 		freq_count = create_freq_array(freq_list, &freq_array);
+		err = machine_model_init_uniform(&model, core_count, freq_count, freq_array);
+		fail_if(err, "cannot allocate machine model");
 		
-		states = create_machine_states(&state_count, core_count, freq_count, freq_array);
+		err = state_table_init(&states, core_count, 1000);
+		fail_if(err, "cannot allocate state table");
+		states.threads = threads;
+		/* with -r there is no point in generating the permutations just to skip them */
+		err = enumerate_states_parallel(&states, &model, skip_redundant, collect_all_states);
+		fail_if(err, "cannot generate machine states");
 	}
-	qsort(states, state_count, STATE_SIZE(core_count), compare_states_on_speed);
-
-	printf("speed\tpower");
-	for (j = 0; j < core_count; j++)
-		printf("\tcore%d", j);
-	printf("\n");
-	
-	for (i = 0, state = states; i < state_count; i++, state+=STATE_LEN(core_count)) {
-		if (skip_redundant && redundant_state(state, core_count))
-			continue;
-		if (skip_equivalent && drop_equivalent(state, i, states, state_count, core_count))
-			continue;
-		if (skip_unoptimal && !pareto_optimal(state, i, states, state_count, core_count))
-			continue;
-
-		printf("%lu\t%lu", state[SPEED_IDX], state[POWER_IDX]);
-		for (j = 0; j < core_count; j++)
-			printf("\t%lu", state[CORE_IDX(j)]);
-		printf("\n");
+	states.threads = threads;
+	err = state_table_sort(&states);
+	fail_if(err, "cannot sort machine states");
+	filters = (skip_redundant ? FILTER_REDUNDANT : 0) | (skip_equivalent ? FILTER_EQUIVALENT : 0) | (skip_unoptimal ? FILTER_UNOPTIMAL : 0);
+	err = state_table_filter(&states, filters) < 0;
+	fail_if(err, "cannot filter machine states");
+	if (output_file_name) {
+		/* not keyed: our uniform model and filters are not what the controller caches, so the file
+		 is only for -f, which loads whatever key it has */
+		err = state_table_save(&states, output_file_name, 0);
+		fail_if(err, "cannot write binary state file");
 	}
+
+	state_table_write_text(&states, stdout);
 	
+	state_table_free(&states);
+	machine_model_free(&model);
 	return 0;
+fail:
+	return 1;
 }
@@ -0,0 +1,215 @@
+/*
+ *  topology.c
+ *  heartbeats
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/errno.h>
+#include <limits.h>
+#include <dirent.h>
+
+#include "topology.h"
+
+#define fail_if(exp, msg) do { if ((exp)) { fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, (msg), strerror(errno)); goto fail; } } while (0)
+
+/* going from 2 to 3 cores shouldn't mean landing on a hyperthread sibling or the other socket, or
+ speed stops growing monotonically with the core count and no controller converges. the kernel
+ knows the layout, so we ask it: cpuN/topology for packages, cores and siblings, cpuN/cache for the
+ last level cache, and the cpuN/nodeM links for NUMA nodes. everything is read relative to a root so
+ a fake tree can stand in for sysfs. */
+
+static int read_int(const char *path, int *value)
+{
+	FILE *f;
+	int ok;
+	
+	f = fopen(path, "r");
+	if (!f) return -1;
+	ok = fscanf(f, "%d", value) == 1;
+	fclose(f);
+	return ok ? 0 : -1;
+}
+
+/* the last level cache is the highest level index; it's named after the first cpu that shares it */
+static int read_llc(const char *root, int cpu, int fallback)
+{
+	char path[PATH_MAX];
+	int index, level, best_level = -1, llc = fallback;
+	
+	for (index = 0; ; index++) {
+		snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/level", root, cpu, index);
+		if (read_int(path, &level)) break;
+		if (level <= best_level) continue;
+		snprintf(path, sizeof(path), "%s/cpu%d/cache/index%d/shared_cpu_list", root, cpu, index);
+		if (read_int(path, &llc)) llc = fallback;
+		best_level = level;
+	}
+	return llc;
+}
+
+static int read_node(const char *root, int cpu)
+{
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *entry;
+	int node = 0, n, end;
+	
+	snprintf(path, sizeof(path), "%s/cpu%d", root, cpu);
+	dir = opendir(path);
+	if (!dir) return 0;
+	while ((entry = readdir(dir)) != NULL) {
+		end = 0;
+		if (sscanf(entry->d_name, "node%d%n", &n, &end) == 1 && entry->d_name[end] == '\0') {
+			node = n;
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+/* reads cpus from 0 up to the first one without a topology directory, which is also how many there
+ are as far as the cpufreq fds and the actuators are concerned */
+int topology_read(topology_t *topo, const char *root)
+{
+	char path[PATH_MAX];
+	cpu_topology_t *c, *bigger;
+	int cpu, i, size = 0;
+	
+	if (!root) root = TOPOLOGY_DEFAULT_ROOT;
+	memset(topo, 0, sizeof(*topo));
+	for (cpu = 0; ; cpu++) {
+		snprintf(path, sizeof(path), "%s/cpu%d/topology/core_id", root, cpu);
+		if (read_int(path, &i)) break;
+		if (cpu == size) {
+			size = size ? size * 2 : 16;
+			bigger = realloc(topo->cpus, sizeof(cpu_topology_t) * size);
+			fail_if(!bigger, "cannot allocate topology");
+			topo->cpus = bigger;
+		}
+		c = &topo->cpus[cpu];
+		c->cpu = cpu;
+		c->core = i;
+		snprintf(path, sizeof(path), "%s/cpu%d/topology/physical_package_id", root, cpu);
+		if (read_int(path, &c->package)) c->package = 0;
+		c->llc = read_llc(root, cpu, -1);
+		c->node = read_node(root, cpu);
+	}
+	if (cpu == 0) errno = ENOENT;
+	fail_if(cpu == 0, "no cpu topology");
+	topo->cpu_count = cpu;
+	
+	for (cpu = 0; cpu < topo->cpu_count; cpu++) {
+		c = &topo->cpus[cpu];
+		/* without cache info, a package is as close as it gets */
+		if (c->llc < 0) {
+			for (i = 0; i < topo->cpu_count && topo->cpus[i].package != c->package; i++);
+			c->llc = i;
+		}
+		c->smt_rank = 0;
+		for (i = 0; i < cpu; i++)
+			if (topo->cpus[i].package == c->package && topo->cpus[i].core == c->core) c->smt_rank++;
+	}
+	for (cpu = 0; cpu < topo->cpu_count; cpu++) {
+		c = &topo->cpus[cpu];
+		c->package_rank = 0;
+		for (i = 0; i < topo->cpu_count; i++) {
+			cpu_topology_t *o = &topo->cpus[i];
+			if (o->package == c->package && o->smt_rank == 0 &&
+				(o->llc < c->llc || (o->llc == c->llc && o->core < c->core))) c->package_rank++;
+		}
+	}
+	
+	topo->order = malloc(sizeof(int) * topo->cpu_count);
+	topo->slot = malloc(sizeof(int) * topo->cpu_count);
+	fail_if(!topo->order || !topo->slot, "cannot allocate allocation order");
+	topology_set_policy(topo, TOPOLOGY_LINEAR);
+	return 0;
+fail:
+	topology_free(topo);
+	return -1;
+}
+
+void topology_free(topology_t *topo)
+{
+	free(topo->cpus);
+	free(topo->order);
+	free(topo->slot);
+	memset(topo, 0, sizeof(*topo));
+}
+
+int topology_policy(const char *name)
+{
+	if (strcmp(name, "linear") == 0) return TOPOLOGY_LINEAR;
+	if (strcmp(name, "compact") == 0) return TOPOLOGY_COMPACT;
+	if (strcmp(name, "spread") == 0) return TOPOLOGY_SPREAD;
+	if (strcmp(name, "nosmt") == 0) return TOPOLOGY_NO_SMT;
+	return -1;
+}
+
+/* qsort has no context argument */
+static topology_t *sorting;
+
+static int policy_key(cpu_topology_t *c, int *key)
+{
+	switch (sorting->policy) {
+		case TOPOLOGY_COMPACT:
+			key[0] = c->node; key[1] = c->llc; key[2] = c->smt_rank; key[3] = c->package; key[4] = c->core;
+			return 5;
+		case TOPOLOGY_SPREAD:
+			key[0] = c->smt_rank; key[1] = c->package_rank; key[2] = c->package;
+			return 3;
+		case TOPOLOGY_NO_SMT:
+			key[0] = c->smt_rank; key[1] = c->node; key[2] = c->llc; key[3] = c->package; key[4] = c->core;
+			return 5;
+		default:
+			return 0;
+	}
+}
+
+static int compare_cpus(const void *a, const void *b)
+{
+	cpu_topology_t *x = &sorting->cpus[*(const int *)a], *y = &sorting->cpus[*(const int *)b];
+	int kx[5], ky[5], i, n;
+	
+	n = policy_key(x, kx);
+	policy_key(y, ky);
+	for (i = 0; i < n; i++)
+		if (kx[i] != ky[i]) return kx[i] < ky[i] ? -1 : 1;
+	return x->cpu - y->cpu;
+}
+
+int topology_set_policy(topology_t *topo, int policy)
+{
+	int i;
+	
+	if (policy < TOPOLOGY_LINEAR || policy > TOPOLOGY_NO_SMT) {
+		errno = EINVAL;
+		return -1;
+	}
+	topo->policy = policy;
+	for (i = 0; i < topo->cpu_count; i++)
+		topo->order[i] = i;
+	sorting = topo;
+	qsort(topo->order, topo->cpu_count, sizeof(int), compare_cpus);
+	for (i = 0; i < topo->cpu_count; i++)
+		topo->slot[topo->order[i]] = i;
+	return 0;
+}
+
+/* the first count cpus in allocation order, as a list for taskset -c; returns the length, or -1 if it doesn't fit */
+int topology_cpu_list(topology_t *topo, int count, char *buf, int size)
+{
+	int i, len = 0, n;
+	
+	buf[0] = '\0';
+	for (i = 0; i < count && i < topo->cpu_count; i++) {
+		n = snprintf(buf + len, size - len, i ? ",%d" : "%d", topo->order[i]);
+		if (n >= size - len) return -1;
+		len += n;
+	}
+	return len;
+}
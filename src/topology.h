@@ -0,0 +1,37 @@
+/*
+ *  topology.h
+ *  heartbeats
+ *
+ */
+
+#define TOPOLOGY_DEFAULT_ROOT "/sys/devices/system/cpu"
+
+/* allocation policies: in which order cores are handed out as an app gets more of them */
+#define TOPOLOGY_LINEAR 0	/* cpu0, cpu1, ... like we always did */
+#define TOPOLOGY_COMPACT 1	/* fill a last level cache domain, siblings last, before moving to the next */
+#define TOPOLOGY_SPREAD 2	/* alternate between packages, siblings last */
+#define TOPOLOGY_NO_SMT 3	/* every physical core first, compactly, then their siblings */
+
+typedef struct cpu_topology {
+	int cpu;
+	int package;	/* physical_package_id */
+	int core;	/* core_id, unique within a package */
+	int llc;	/* lowest cpu sharing the last level cache with this one */
+	int node;	/* NUMA node */
+	int smt_rank;	/* 0 for the first thread of a core, 1 for the next sibling... */
+	int package_rank;	/* position of the core within its package */
+} cpu_topology_t;
+
+typedef struct topology {
+	int cpu_count;
+	cpu_topology_t *cpus;	/* by cpu number */
+	int policy;
+	int *order;	/* slot -> cpu: the order cores are handed out in */
+	int *slot;	/* cpu -> slot */
+} topology_t;
+
+int topology_read(topology_t *topo, const char *root);
+void topology_free(topology_t *topo);
+int topology_policy(const char *name);
+int topology_set_policy(topology_t *topo, int policy);
+int topology_cpu_list(topology_t *topo, int count, char *buf, int size);